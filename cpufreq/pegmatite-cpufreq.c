@@ -0,0 +1,201 @@
+/*
+ * drivers/cpufreq/pegmatite-cpufreq.c
+ *
+ * CPU frequency scaling for Pegmatite processors
+ *
+ * The A-cores run straight off the cpu pll, so scaling is a clk_set_rate()
+ * on that pll.  The pll driver retunes neighbouring rates by changing only
+ * its frequency offset and falls back to a full relock otherwise, so the
+ * cost of a transition depends on the pair of operating points.  The
+ * reported transition latency is the device tree clock-latency or, when
+ * the cpu node has none, the slowest transition measured once at init.
+ *
+ * This file is licensed under  the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/err.h>
+#include <linux/clk.h>
+#include <linux/cpu.h>
+#include <linux/cpufreq.h>
+#include <linux/ktime.h>
+#include <linux/of.h>
+#include <linux/pm_opp.h>
+
+/*
+ * Used when the cpu node has no clock-latency and the measurement at init
+ * fails, in ns.  This is about what a full pll relock costs.
+ */
+#define PEGMATITE_CPUFREQ_DEFAULT_LATENCY	500000
+
+static struct device *cpu_dev;
+static struct clk *cpu_clk;
+static struct cpufreq_frequency_table *freq_table;
+static unsigned int transition_latency;
+
+static int pegmatite_cpufreq_target_index(struct cpufreq_policy *policy,
+					  unsigned int index)
+{
+	unsigned long new_rate = freq_table[index].frequency * 1000;
+	int ret;
+
+	ret = clk_set_rate(cpu_clk, new_rate);
+	if (ret) {
+		dev_err(cpu_dev, "failed to set cpu clock to %lu Hz: %d\n",
+			new_rate, ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Time a transition to the lowest and to the highest operating point and
+ * back to where we started, and return the slowest one in ns.  The worst
+ * case is a full relock, which at least one of these hops will take.
+ * The governors read cpuinfo.transition_latency only when they start, so
+ * this runs once, before the driver is registered.
+ */
+static unsigned int __init pegmatite_cpufreq_measure_latency(void)
+{
+	struct cpufreq_frequency_table *pos;
+	unsigned long rates[3];
+	unsigned long orig_rate;
+	unsigned int latency = 0;
+	unsigned int min = UINT_MAX, max = 0;
+	ktime_t start;
+	s64 ns;
+	int i;
+
+	cpufreq_for_each_valid_entry(pos, freq_table) {
+		if (pos->frequency < min)
+			min = pos->frequency;
+		if (pos->frequency > max)
+			max = pos->frequency;
+	}
+	if (!max)
+		return 0;
+
+	orig_rate = clk_get_rate(cpu_clk);
+	rates[0] = min * 1000UL;
+	rates[1] = max * 1000UL;
+	rates[2] = orig_rate;
+
+	for (i = 0; i < ARRAY_SIZE(rates); i++) {
+		start = ktime_get();
+		if (clk_set_rate(cpu_clk, rates[i])) {
+			clk_set_rate(cpu_clk, orig_rate);
+			return 0;
+		}
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		if (ns > latency)
+			latency = (unsigned int)ns;
+	}
+
+	return latency;
+}
+
+static int pegmatite_cpufreq_init(struct cpufreq_policy *policy)
+{
+	policy->clk = cpu_clk;
+
+	/*
+	 * All cores share the cpu pll
+	 */
+	return cpufreq_generic_init(policy, freq_table, transition_latency);
+}
+
+static struct cpufreq_driver pegmatite_cpufreq_driver = {
+	.flags		= CPUFREQ_STICKY | CPUFREQ_NEED_INITIAL_FREQ_CHECK,
+	.verify		= cpufreq_generic_frequency_table_verify,
+	.target_index	= pegmatite_cpufreq_target_index,
+	.get		= cpufreq_generic_get,
+	.init		= pegmatite_cpufreq_init,
+	.name		= "pegmatite",
+	.attr		= cpufreq_generic_attr,
+};
+
+static int __init pegmatite_cpufreq_driver_init(void)
+{
+	struct device_node *np;
+	int ret;
+
+	if (!of_machine_is_compatible("marvell,pegmatite"))
+		return -ENODEV;
+
+	cpu_dev = get_cpu_device(0);
+	if (!cpu_dev) {
+		pr_err("pegmatite-cpufreq: failed to get cpu0 device\n");
+		return -ENODEV;
+	}
+
+	np = of_node_get(cpu_dev->of_node);
+	if (!np) {
+		dev_err(cpu_dev, "failed to find cpu0 node\n");
+		return -ENOENT;
+	}
+
+	cpu_clk = clk_get(cpu_dev, NULL);
+	if (IS_ERR(cpu_clk)) {
+		ret = PTR_ERR(cpu_clk);
+		dev_err(cpu_dev, "failed to get cpu clock: %d\n", ret);
+		goto out_put_node;
+	}
+
+	ret = of_init_opp_table(cpu_dev);
+	if (ret) {
+		dev_err(cpu_dev, "failed to init OPP table: %d\n", ret);
+		goto out_put_clk;
+	}
+
+	ret = dev_pm_opp_init_cpufreq_table(cpu_dev, &freq_table);
+	if (ret) {
+		dev_err(cpu_dev, "failed to init cpufreq table: %d\n", ret);
+		goto out_free_opp;
+	}
+
+	if (of_property_read_u32(np, "clock-latency", &transition_latency)) {
+		transition_latency = pegmatite_cpufreq_measure_latency();
+		if (transition_latency)
+			dev_info(cpu_dev, "measured transition latency %u ns\n",
+				 transition_latency);
+		else
+			transition_latency = PEGMATITE_CPUFREQ_DEFAULT_LATENCY;
+	}
+
+	ret = cpufreq_register_driver(&pegmatite_cpufreq_driver);
+	if (ret) {
+		dev_err(cpu_dev, "failed to register driver: %d\n", ret);
+		goto out_free_table;
+	}
+
+	of_node_put(np);
+	return 0;
+
+out_free_table:
+	dev_pm_opp_free_cpufreq_table(cpu_dev, &freq_table);
+out_free_opp:
+	of_free_opp_table(cpu_dev);
+out_put_clk:
+	clk_put(cpu_clk);
+out_put_node:
+	of_node_put(np);
+	return ret;
+}
+module_init(pegmatite_cpufreq_driver_init);
+
+static void __exit pegmatite_cpufreq_driver_exit(void)
+{
+	cpufreq_unregister_driver(&pegmatite_cpufreq_driver);
+	dev_pm_opp_free_cpufreq_table(cpu_dev, &freq_table);
+	of_free_opp_table(cpu_dev);
+	clk_put(cpu_clk);
+}
+module_exit(pegmatite_cpufreq_driver_exit);
+
+MODULE_DESCRIPTION("Pegmatite cpufreq driver");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,409 @@
+/*
+ * drivers/devfreq/pegmatite-ddr-devfreq.c
+ *
+ * DDR bandwidth scaling for Pegmatite processors
+ *
+ * The DDR clock is a clkgen with a use-div-sel divider (pll / 2 or pll / 4),
+ * so scaling is a clk_set_rate() on that clock.  The cpu runs from DRAM
+ * while this happens and there is no self-refresh handshake with the
+ * controller, so only the divider may move: a pll retune would take the
+ * DDR clock through bypass and reset under a live controller.  Operating
+ * points the divider cannot reach from the current pll rate are disabled
+ * at probe, and a transition that would touch the pll is refused.
+ * Load comes from a pair of free-running DDR controller counters (busy
+ * cycles and total cycles), whose offsets come from the device tree,
+ * sampled every polling interval and fed to the simple_ondemand governor.
+ * The governor thresholds are exposed as sysfs attributes of the device.
+ *
+ * This file is licensed under  the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/platform_device.h>
+#include <linux/err.h>
+#include <linux/io.h>
+#include <linux/math64.h>
+#include <linux/clk.h>
+#include <linux/of.h>
+#include <linux/devfreq.h>
+#include <linux/pm_opp.h>
+#include <linux/rcupdate.h>
+
+#define DDR_DEFAULT_POLLING_MS		50
+#define DDR_DEFAULT_UPTHRESHOLD		80
+#define DDR_DEFAULT_DOWNDIFFERENTIAL	20
+
+struct pegmatite_ddr_data {
+	struct devfreq *devfreq;
+	struct devfreq_simple_ondemand_data ondemand;
+	struct devfreq_dev_profile profile;
+	struct clk *clk;
+	struct clk *pll;
+	unsigned long pll_rate;	/* the pll rate at probe, which must not move */
+	void __iomem *reg;
+	u32 busy_offset;
+	u32 total_offset;
+	u32 last_busy;
+	u32 last_total;
+	unsigned int last_load;	/* percent, from the last sample */
+};
+
+/*
+ * The clkgen divider can only give pll / 2 or pll / 4
+ */
+static bool pegmatite_ddr_divider_reachable(unsigned long pll_rate, unsigned long rate)
+{
+	unsigned long div;
+
+	if (!rate)
+		return false;
+
+	div = pll_rate / rate;
+	return div * rate == pll_rate && (div == 2 || div == 4);
+}
+
+static int pegmatite_ddr_target(struct device *dev, unsigned long *freq, u32 flags)
+{
+	struct pegmatite_ddr_data *ddr = dev_get_drvdata(dev);
+	struct dev_pm_opp *opp;
+	unsigned long rate;
+	int ret;
+
+	rcu_read_lock();
+	opp = devfreq_recommended_opp(dev, freq, flags);
+	if (IS_ERR(opp)) {
+		rcu_read_unlock();
+		return PTR_ERR(opp);
+	}
+	rate = dev_pm_opp_get_freq(opp);
+	rcu_read_unlock();
+
+	if (rate == clk_get_rate(ddr->clk)) {
+		*freq = rate;
+		return 0;
+	}
+
+	/*
+	 * Never let the request propagate to the pll
+	 */
+	if (clk_get_rate(ddr->pll) != ddr->pll_rate ||
+	    !pegmatite_ddr_divider_reachable(ddr->pll_rate, rate) ||
+	    clk_round_rate(ddr->clk, rate) != rate) {
+		dev_err(dev, "%lu Hz needs a ddr pll retune, refusing\n", rate);
+		return -EINVAL;
+	}
+
+	ret = clk_set_rate(ddr->clk, rate);
+	if (ret) {
+		dev_err(dev, "failed to set ddr clock to %lu Hz: %d\n", rate, ret);
+		return ret;
+	}
+
+	*freq = clk_get_rate(ddr->clk);
+
+	return 0;
+}
+
+static int pegmatite_ddr_get_dev_status(struct device *dev,
+					struct devfreq_dev_status *stat)
+{
+	struct pegmatite_ddr_data *ddr = dev_get_drvdata(dev);
+	u32 busy, total;
+
+	busy = readl(ddr->reg + ddr->busy_offset);
+	total = readl(ddr->reg + ddr->total_offset);
+
+	/*
+	 * The counters are free running, so unsigned subtraction handles
+	 * the wrap
+	 */
+	stat->busy_time = busy - ddr->last_busy;
+	stat->total_time = total - ddr->last_total;
+	stat->current_frequency = clk_get_rate(ddr->clk);
+
+	ddr->last_busy = busy;
+	ddr->last_total = total;
+
+	if (stat->total_time)
+		ddr->last_load = (unsigned int)div_u64((u64)stat->busy_time * 100,
+						       stat->total_time);
+
+	return 0;
+}
+
+static int pegmatite_ddr_get_cur_freq(struct device *dev, unsigned long *freq)
+{
+	struct pegmatite_ddr_data *ddr = dev_get_drvdata(dev);
+
+	*freq = clk_get_rate(ddr->clk);
+
+	return 0;
+}
+
+/*
+ * simple_ondemand reads its thresholds on every update, so changing them
+ * only needs a re-evaluation under the devfreq lock.  The attributes exist
+ * before the devfreq device does; until then the new value is simply
+ * picked up when the governor starts.
+ */
+static ssize_t pegmatite_ddr_store_threshold(struct device *dev, const char *buf,
+					     size_t count, unsigned int *threshold)
+{
+	struct pegmatite_ddr_data *ddr = dev_get_drvdata(dev);
+	struct devfreq *devfreq;
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	if (val > 100)
+		return -EINVAL;
+
+	devfreq = ACCESS_ONCE(ddr->devfreq);
+	if (!devfreq) {
+		*threshold = val;
+		return count;
+	}
+
+	mutex_lock(&devfreq->lock);
+	*threshold = val;
+	ret = update_devfreq(devfreq);
+	mutex_unlock(&devfreq->lock);
+
+	return ret ? ret : count;
+}
+
+static ssize_t upthreshold_show(struct device *dev, struct device_attribute *attr,
+				char *buf)
+{
+	struct pegmatite_ddr_data *ddr = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", ddr->ondemand.upthreshold);
+}
+
+static ssize_t upthreshold_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct pegmatite_ddr_data *ddr = dev_get_drvdata(dev);
+
+	return pegmatite_ddr_store_threshold(dev, buf, count, &ddr->ondemand.upthreshold);
+}
+static DEVICE_ATTR_RW(upthreshold);
+
+static ssize_t downdifferential_show(struct device *dev, struct device_attribute *attr,
+				     char *buf)
+{
+	struct pegmatite_ddr_data *ddr = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", ddr->ondemand.downdifferential);
+}
+
+static ssize_t downdifferential_store(struct device *dev, struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct pegmatite_ddr_data *ddr = dev_get_drvdata(dev);
+
+	return pegmatite_ddr_store_threshold(dev, buf, count, &ddr->ondemand.downdifferential);
+}
+static DEVICE_ATTR_RW(downdifferential);
+
+/*
+ * Load and rate of the last sample, to see what each step actually delivers
+ */
+static ssize_t load_show(struct device *dev, struct device_attribute *attr,
+			 char *buf)
+{
+	struct pegmatite_ddr_data *ddr = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u%% @ %lu Hz\n", ddr->last_load, clk_get_rate(ddr->clk));
+}
+static DEVICE_ATTR_RO(load);
+
+static struct attribute *pegmatite_ddr_attrs[] = {
+	&dev_attr_upthreshold.attr,
+	&dev_attr_downdifferential.attr,
+	&dev_attr_load.attr,
+	NULL,
+};
+
+ATTRIBUTE_GROUPS(pegmatite_ddr);
+
+/*
+ * Disable every operating point the divider cannot reach from the pll
+ * rate, so the governor never asks for one.  dev_pm_opp_disable takes the
+ * opp mutex and cannot run under the rcu read lock, so the unreachable
+ * ones are collected a batch at a time; disabled points no longer show up
+ * in the next pass.
+ */
+static int pegmatite_ddr_disable_unreachable_opps(struct device *dev,
+						  unsigned long pll_rate)
+{
+	struct dev_pm_opp *opp;
+	unsigned long bad[8];
+	unsigned long freq;
+	int nbad, usable;
+	int i, ret;
+
+	do {
+		nbad = 0;
+		usable = 0;
+		freq = 0;
+
+		rcu_read_lock();
+		while (!IS_ERR(opp = dev_pm_opp_find_freq_ceil(dev, &freq))) {
+			if (pegmatite_ddr_divider_reachable(pll_rate, freq))
+				usable++;
+			else if (nbad < ARRAY_SIZE(bad))
+				bad[nbad++] = freq;
+			freq++;
+		}
+		rcu_read_unlock();
+
+		for (i = 0; i < nbad; i++) {
+			dev_warn(dev, "disabling %lu Hz, not reachable from the %lu Hz pll\n",
+				 bad[i], pll_rate);
+			ret = dev_pm_opp_disable(dev, bad[i]);
+			if (ret)
+				return ret;
+		}
+	} while (nbad == ARRAY_SIZE(bad));
+
+	if (!usable) {
+		dev_err(dev, "no operating point reachable from the %lu Hz pll\n",
+			pll_rate);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int pegmatite_ddr_probe(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct pegmatite_ddr_data *ddr;
+	struct devfreq *devfreq;
+	u32 polling_ms;
+	int ret;
+
+	ddr = devm_kzalloc(dev, sizeof(*ddr), GFP_KERNEL);
+	if (!ddr) {
+		dev_err(dev, "Failed to allocate memory for ddr devfreq data\n");
+		return -ENOMEM;
+	}
+	platform_set_drvdata(pdev, ddr);
+
+	ddr->reg = devm_ioremap_resource(dev,
+			platform_get_resource(pdev, IORESOURCE_MEM, 0));
+	if (IS_ERR(ddr->reg))
+		return PTR_ERR(ddr->reg);
+
+	/*
+	 * The counter locations differ between controller revisions and
+	 * there is no safe default
+	 */
+	if (of_property_read_u32(dev->of_node, "busy-counter-offset", &ddr->busy_offset) ||
+	    of_property_read_u32(dev->of_node, "total-counter-offset", &ddr->total_offset)) {
+		dev_err(dev, "busy-counter-offset and total-counter-offset are required\n");
+		return -EINVAL;
+	}
+	if (of_property_read_u32(dev->of_node, "polling-ms", &polling_ms))
+		polling_ms = DDR_DEFAULT_POLLING_MS;
+
+	ddr->clk = devm_clk_get(dev, NULL);
+	if (IS_ERR(ddr->clk)) {
+		dev_err(dev, "Failed to get ddr clock\n");
+		return PTR_ERR(ddr->clk);
+	}
+
+	ddr->pll = clk_get_parent(ddr->clk);
+	if (!ddr->pll) {
+		dev_err(dev, "ddr clock has no parent\n");
+		return -EINVAL;
+	}
+	ddr->pll_rate = clk_get_rate(ddr->pll);
+
+	ret = of_init_opp_table(dev);
+	if (ret) {
+		dev_err(dev, "Failed to init OPP table: %d\n", ret);
+		return ret;
+	}
+
+	ret = pegmatite_ddr_disable_unreachable_opps(dev, ddr->pll_rate);
+	if (ret)
+		goto out_free_opp;
+
+	ddr->last_busy = readl(ddr->reg + ddr->busy_offset);
+	ddr->last_total = readl(ddr->reg + ddr->total_offset);
+
+	ddr->ondemand.upthreshold = DDR_DEFAULT_UPTHRESHOLD;
+	ddr->ondemand.downdifferential = DDR_DEFAULT_DOWNDIFFERENTIAL;
+
+	ddr->profile.initial_freq = clk_get_rate(ddr->clk);
+	ddr->profile.polling_ms = polling_ms;
+	ddr->profile.target = pegmatite_ddr_target;
+	ddr->profile.get_dev_status = pegmatite_ddr_get_dev_status;
+	ddr->profile.get_cur_freq = pegmatite_ddr_get_cur_freq;
+
+	/*
+	 * The attributes go up before the devfreq device, so they are in
+	 * place by the time its uevent reaches userspace
+	 */
+	ret = sysfs_create_groups(&dev->kobj, pegmatite_ddr_groups);
+	if (ret)
+		goto out_free_opp;
+
+	devfreq = devfreq_add_device(dev, &ddr->profile,
+				     "simple_ondemand", &ddr->ondemand);
+	if (IS_ERR(devfreq)) {
+		dev_err(dev, "Failed to add devfreq device\n");
+		ret = PTR_ERR(devfreq);
+		goto out_remove_groups;
+	}
+	ddr->devfreq = devfreq;
+
+	return 0;
+
+out_remove_groups:
+	sysfs_remove_groups(&dev->kobj, pegmatite_ddr_groups);
+out_free_opp:
+	of_free_opp_table(dev);
+	return ret;
+}
+
+static int pegmatite_ddr_remove(struct platform_device *pdev)
+{
+	struct pegmatite_ddr_data *ddr = platform_get_drvdata(pdev);
+
+	devfreq_remove_device(ddr->devfreq);
+	sysfs_remove_groups(&pdev->dev.kobj, pegmatite_ddr_groups);
+	of_free_opp_table(&pdev->dev);
+
+	return 0;
+}
+
+static const struct of_device_id pegmatite_ddr_of_match_table[] = {
+	{ .compatible = "marvell,pegmatite-ddr-devfreq", },
+	{},
+};
+MODULE_DEVICE_TABLE(of, pegmatite_ddr_of_match_table);
+
+static struct platform_driver pegmatite_ddr_driver = {
+	.probe		= pegmatite_ddr_probe,
+	.remove		= pegmatite_ddr_remove,
+	.driver		= {
+		.owner	= THIS_MODULE,
+		.name	= "pegmatite-ddr-devfreq",
+		.of_match_table = pegmatite_ddr_of_match_table,
+	},
+};
+
+module_platform_driver(pegmatite_ddr_driver);
+
+MODULE_DESCRIPTION("Pegmatite DDR devfreq driver");
+MODULE_LICENSE("GPL");
+MODULE_ALIAS("platform:pegmatite-ddr-devfreq");
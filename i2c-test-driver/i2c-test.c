@@ -7,12 +7,22 @@
 #include <linux/io.h>
 #include <linux/string.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/moduleparam.h>
 #include <linux/i2c.h>
 #include <linux/compiler.h>
 #include <linux/dcache.h>
 #include <linux/debugfs.h>
 #include <linux/random.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+#include <linux/sort.h>
+#include <linux/mutex.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <linux/fs.h>
 
 /*
  * Usage: insmod i2c-test.ko i2c_num=0 i2c_dev_addr=0x53
@@ -38,6 +48,37 @@
  * read-buf-0 should contains the data that is same as write-buf-0  
  * read-buf-1 should contains the data that is same as write-buf-1 
  *
+ * /sys/kernel/debug/i2c_test/bench
+ *
+ * Writing a shape name to bench runs a benchmark against the i2c_num bus
+ * and i2c_dev_addr device (both read again on every run), and reading it
+ * shows the results of the last run:
+ *
+ *   read        offset write + read, one i2c_transfer
+ *   multi-read  two offset write + read pairs in one i2c_transfer, the
+ *               first read ended with I2C_M_STOP
+ *   split-read  the same two pairs as two i2c_transfer calls
+ *   write       offset write + I2C_M_NOSTART data (at most one eeprom
+ *               page), then ACK polling until the write cycle is done;
+ *               this overwrites eeprom data from offset 0x10
+ *
+ * bench_size is the bytes per read or write and bench_iterations the
+ * number of transfers, e.g.
+ *
+ *   echo 32 > /sys/module/i2c_test/parameters/bench_size
+ *   echo multi-read > /sys/kernel/debug/i2c_test/bench
+ *   cat /sys/kernel/debug/i2c_test/bench
+ *
+ * /sys/kernel/debug/i2c_test/image
+ * /sys/kernel/debug/i2c_test/eeprom
+ *
+ * image is a 256-byte eeprom image, read and written like a file.
+ * Writing "save" to eeprom reads the device into image, and "restore"
+ * writes image back to the device: only pages that differ are written,
+ * eeprom_page_size bytes at a time, each followed by ACK polling, and
+ * the device is read back and any page that still differs written again.
+ * Reading eeprom shows the results of the last save or restore.
+ *
  * The test code is for checking the modification of i2c-pxa driver.
  * 
  * There are 2 restrictions in the original i2c_pxa_do_xfer()
@@ -74,6 +115,82 @@ static uint8_t i2c_read_buf_1[I2C_TEST_RDWR_LENGTH];
 static uint8_t i2c_write_buf_0[I2C_TEST_RDWR_LENGTH];
 static uint8_t i2c_write_buf_1[I2C_TEST_RDWR_LENGTH];
 
+// STTS2002 eeprom write page, and the longest write cycle in the datasheet
+#define I2C_TEST_EEPROM_PAGE_SIZE   16
+#define I2C_TEST_EEPROM_WRITE_MS    10
+
+static uint bench_size = I2C_TEST_RDWR_LENGTH;
+module_param(bench_size, uint, 0644);
+
+static uint bench_iterations = 1000;
+module_param(bench_iterations, uint, 0644);
+
+#define I2C_TEST_BENCH_MAX_ITERATIONS   100000
+#define I2C_TEST_BENCH_OFFSET           0x10
+
+enum i2c_test_bench_shape {
+    I2C_TEST_BENCH_READ,
+    I2C_TEST_BENCH_MULTI_READ,
+    I2C_TEST_BENCH_SPLIT_READ,
+    I2C_TEST_BENCH_WRITE,
+    I2C_TEST_BENCH_NR_SHAPES,
+};
+
+static const char * const i2c_test_bench_shapes[I2C_TEST_BENCH_NR_SHAPES] = {
+    [I2C_TEST_BENCH_READ]       = "read",
+    [I2C_TEST_BENCH_MULTI_READ] = "multi-read",
+    [I2C_TEST_BENCH_SPLIT_READ] = "split-read",
+    [I2C_TEST_BENCH_WRITE]      = "write",
+};
+
+/*
+ * results of the last benchmark run, latencies in ns
+ */
+static struct {
+    bool        valid;
+    int         shape;
+    uint        bus;
+    uint        addr;
+    uint        size;
+    uint        iterations;
+    uint        errors;
+    u64         bytes;
+    u64         elapsed_ns;
+    u64         wait_ns;        // write cycle ACK polling, not in the latencies
+    u32         min_ns;
+    u32         p50_ns;
+    u32         p90_ns;
+    u32         p99_ns;
+    u32         max_ns;
+} bench;
+
+static DEFINE_MUTEX(bench_mutex);
+
+static uint eeprom_page_size = I2C_TEST_EEPROM_PAGE_SIZE;
+module_param(eeprom_page_size, uint, 0644);
+
+#define I2C_TEST_EEPROM_RETRIES     3
+
+static uint8_t eeprom_image[I2C_TEST_EEPROM_SIZE];
+
+/*
+ * results of the last save or restore
+ */
+static struct {
+    bool        valid;
+    bool        restore;
+    int         result;
+    uint        pages;
+    uint        dirty;          // pages that differed before the restore
+    uint        written;        // page writes, including rewrites
+    uint        passes;         // write + verify passes
+    u64         elapsed_ns;
+    u64         write_ns;       // page writes and their ACK polling
+    u64         verify_ns;      // reading back
+} eeprom_stats;
+
+static DEFINE_MUTEX(eeprom_mutex);
+
 static void i2c_test_msg_prepare(struct i2c_msg msgs[], uint8_t i2c_dev_addr,  uint8_t *offset, uint8_t *buf,  uint16_t len, uint16_t operation)
 {
 
@@ -113,6 +230,288 @@ int i2c_test_eeprom_save(uint8_t *buffer, uint16_t size)
 }
 
 
+/*
+ * After a write the eeprom doesn't ACK its address until the write cycle is
+ * done, so keep addressing it (an offset write only moves its pointer)
+ * rather than sleeping for the worst case
+ * return 0 when it answers
+*/
+int i2c_test_eeprom_wait_ready(struct i2c_adapter *adap, uint addr)
+{
+    unsigned long   timeout = jiffies + msecs_to_jiffies(I2C_TEST_EEPROM_WRITE_MS) + 1;
+    uint8_t         offset = 0;
+    struct i2c_msg  msg;
+
+    msg.addr = addr;
+    msg.flags = 0;
+    msg.len = 1;
+    msg.buf = &offset;
+
+    do {
+        if (i2c_transfer(adap, &msg, 1) == 1)
+            return 0;
+        usleep_range(50, 100);
+    } while (time_before(jiffies, timeout));
+
+    return i2c_transfer(adap, &msg, 1) == 1 ? 0 : -ETIMEDOUT;
+}
+
+/*
+ * one benchmark transfer of the given shape
+ * return the payload bytes moved, or a negative error
+*/
+static int i2c_test_bench_one(struct i2c_adapter *adap, uint addr, int shape,
+                              uint8_t *buf, uint size)
+{
+    uint8_t        offset[2] = { I2C_TEST_BENCH_OFFSET, I2C_TEST_BENCH_OFFSET + 0x20 };
+    struct i2c_msg msgs[4];
+    int            ret;
+
+    switch (shape) {
+    case I2C_TEST_BENCH_READ:
+        i2c_test_msg_prepare(msgs, addr, &offset[0], buf, size, I2C_M_RD);
+        ret = i2c_transfer(adap, msgs, 2);
+        return ret == 2 ? size : (ret < 0 ? ret : -EIO);
+
+    case I2C_TEST_BENCH_MULTI_READ:
+        i2c_test_msg_prepare(&msgs[0], addr, &offset[0], buf, size, I2C_M_RD | I2C_M_STOP);
+        i2c_test_msg_prepare(&msgs[2], addr, &offset[1], buf + size, size, I2C_M_RD);
+        ret = i2c_transfer(adap, msgs, 4);
+        return ret == 4 ? 2 * size : (ret < 0 ? ret : -EIO);
+
+    case I2C_TEST_BENCH_SPLIT_READ:
+        i2c_test_msg_prepare(&msgs[0], addr, &offset[0], buf, size, I2C_M_RD);
+        i2c_test_msg_prepare(&msgs[2], addr, &offset[1], buf + size, size, I2C_M_RD);
+        ret = i2c_transfer(adap, &msgs[0], 2);
+        if (ret == 2)
+            ret = i2c_transfer(adap, &msgs[2], 2);
+        return ret == 2 ? 2 * size : (ret < 0 ? ret : -EIO);
+
+    case I2C_TEST_BENCH_WRITE:
+        // data message continues the offset message, as in the test above
+        i2c_test_msg_prepare(msgs, addr, &offset[0], buf, size, I2C_M_NOSTART);
+        ret = i2c_transfer(adap, msgs, 2);
+        return ret == 2 ? size : (ret < 0 ? ret : -EIO);
+    }
+
+    return -EINVAL;
+}
+
+static int i2c_test_bench_cmp(const void *a, const void *b)
+{
+    u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * run bench_iterations transfers and fill in bench
+*/
+static int i2c_test_bench_run(int shape)
+{
+    struct i2c_adapter *adap;
+    uint        size = bench_size;
+    uint        iterations = bench_iterations;
+    uint        addr = i2c_dev_addr;
+    uint8_t     *buf;
+    u32         *lat;
+    ktime_t     start, t0, t1;
+    uint        i, n = 0;
+    int         ret = 0;
+
+    if (shape == I2C_TEST_BENCH_WRITE)
+        size = min_t(uint, size, I2C_TEST_EEPROM_PAGE_SIZE - (I2C_TEST_BENCH_OFFSET % I2C_TEST_EEPROM_PAGE_SIZE));
+    if (!size || size > I2C_TEST_EEPROM_SIZE)
+        return -EINVAL;
+    if (!iterations || iterations > I2C_TEST_BENCH_MAX_ITERATIONS)
+        return -EINVAL;
+
+    adap = i2c_get_adapter(i2c_num);
+    if (!adap) {
+        printk(KERN_ERR "i2c_test: no i2c-%u\n", i2c_num);
+        return -ENODEV;
+    }
+
+    buf = kmalloc(2 * size, GFP_KERNEL);
+    /* up to 400 KB of latencies, which needn't be physically contiguous */
+    lat = vmalloc(iterations * sizeof(*lat));
+    if (!buf || !lat) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    get_random_bytes(buf, 2 * size);
+
+    memset(&bench, 0, sizeof(bench));
+    bench.shape = shape;
+    bench.bus = i2c_num;
+    bench.addr = addr;
+    bench.size = size;
+    bench.iterations = iterations;
+
+    start = ktime_get();
+    for (i = 0; i < iterations; i++) {
+        t0 = ktime_get();
+        ret = i2c_test_bench_one(adap, addr, shape, buf, size);
+        t1 = ktime_get();
+
+        if (ret < 0) {
+            bench.errors++;
+        } else {
+            bench.bytes += ret;
+            lat[n++] = (u32)min_t(s64, ktime_to_ns(ktime_sub(t1, t0)), U32_MAX);
+        }
+
+        if (shape == I2C_TEST_BENCH_WRITE) {
+            i2c_test_eeprom_wait_ready(adap, addr);
+            bench.wait_ns += ktime_to_ns(ktime_sub(ktime_get(), t1));
+        }
+    }
+    bench.elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    ret = 0;
+
+    if (n) {
+        sort(lat, n, sizeof(*lat), i2c_test_bench_cmp, NULL);
+        bench.min_ns = lat[0];
+        bench.p50_ns = lat[n * 50 / 100];
+        bench.p90_ns = lat[n * 90 / 100];
+        bench.p99_ns = lat[n * 99 / 100];
+        bench.max_ns = lat[n - 1];
+    }
+    bench.valid = true;
+
+out:
+    vfree(lat);
+    kfree(buf);
+    i2c_put_adapter(adap);
+    return ret;
+}
+
+/*
+ * read len bytes from offset in one transfer
+*/
+static int i2c_test_eeprom_read(struct i2c_adapter *adap, uint addr, uint8_t offset,
+                                uint8_t *buf, uint16_t len)
+{
+    struct i2c_msg msgs[2];
+
+    i2c_test_msg_prepare(msgs, addr, &offset, buf, len, I2C_M_RD);
+    return i2c_transfer(adap, msgs, 2) == 2 ? 0 : -EIO;
+}
+
+/*
+ * write one page (offset must be page aligned) and wait for its write cycle
+*/
+static int i2c_test_eeprom_write_page(struct i2c_adapter *adap, uint addr, uint8_t offset,
+                                      const uint8_t *data, uint16_t len)
+{
+    uint8_t        temp_buf[I2C_TEST_EEPROM_SIZE + 1];
+    struct i2c_msg msg;
+
+    temp_buf[0] = offset;
+    memcpy(&temp_buf[1], data, len);
+
+    msg.addr = addr;
+    msg.flags = 0;
+    msg.len = len + 1;
+    msg.buf = temp_buf;
+
+    if (i2c_transfer(adap, &msg, 1) != 1)
+        return -EIO;
+
+    return i2c_test_eeprom_wait_ready(adap, addr);
+}
+
+/*
+ * Write eeprom_image back to the device, touching only the pages that
+ * differ, and read back until it matches or I2C_TEST_EEPROM_RETRIES
+ * passes have been made
+*/
+static int i2c_test_eeprom_restore(struct i2c_adapter *adap, uint addr)
+{
+    uint8_t     cur[I2C_TEST_EEPROM_SIZE];
+    uint        page_size = eeprom_page_size;
+    uint        pages = I2C_TEST_EEPROM_SIZE / page_size;
+    uint        page, dirty;
+    ktime_t     t0;
+    int         ret;
+
+    eeprom_stats.pages = pages;
+
+    t0 = ktime_get();
+    ret = i2c_test_eeprom_read(adap, addr, 0, cur, I2C_TEST_EEPROM_SIZE);
+    eeprom_stats.verify_ns += ktime_to_ns(ktime_sub(ktime_get(), t0));
+    if (ret)
+        return ret;
+
+    while (eeprom_stats.passes < I2C_TEST_EEPROM_RETRIES) {
+        dirty = 0;
+        for (page = 0; page < pages; page++) {
+            uint offset = page * page_size;
+
+            if (!memcmp(&cur[offset], &eeprom_image[offset], page_size))
+                continue;
+            dirty++;
+
+            t0 = ktime_get();
+            ret = i2c_test_eeprom_write_page(adap, addr, offset, &eeprom_image[offset], page_size);
+            eeprom_stats.write_ns += ktime_to_ns(ktime_sub(ktime_get(), t0));
+            if (ret)
+                return ret;
+            eeprom_stats.written++;
+        }
+
+        if (!eeprom_stats.passes)
+            eeprom_stats.dirty = dirty;
+        if (!dirty)
+            return 0;
+        eeprom_stats.passes++;
+
+        t0 = ktime_get();
+        ret = i2c_test_eeprom_read(adap, addr, 0, cur, I2C_TEST_EEPROM_SIZE);
+        eeprom_stats.verify_ns += ktime_to_ns(ktime_sub(ktime_get(), t0));
+        if (ret)
+            return ret;
+
+        if (!memcmp(cur, eeprom_image, I2C_TEST_EEPROM_SIZE))
+            return 0;
+    }
+
+    printk(KERN_ERR "i2c_test: eeprom still differs after %u passes\n", eeprom_stats.passes);
+    return -EIO;
+}
+
+static int i2c_test_eeprom_run(bool restore)
+{
+    struct i2c_adapter *adap;
+    ktime_t     start;
+
+    // page writes must not cross a page, and pages must tile the device
+    if (!eeprom_page_size || eeprom_page_size > I2C_TEST_EEPROM_SIZE ||
+        !is_power_of_2(eeprom_page_size))
+        return -EINVAL;
+
+    adap = i2c_get_adapter(i2c_num);
+    if (!adap) {
+        printk(KERN_ERR "i2c_test: no i2c-%u\n", i2c_num);
+        return -ENODEV;
+    }
+
+    memset(&eeprom_stats, 0, sizeof(eeprom_stats));
+    eeprom_stats.restore = restore;
+
+    start = ktime_get();
+    if (restore)
+        eeprom_stats.result = i2c_test_eeprom_restore(adap, i2c_dev_addr);
+    else
+        eeprom_stats.result = i2c_test_eeprom_read(adap, i2c_dev_addr, 0,
+                                                   eeprom_image, I2C_TEST_EEPROM_SIZE);
+    eeprom_stats.elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    eeprom_stats.valid = true;
+
+    i2c_put_adapter(adap);
+    return eeprom_stats.result;
+}
+
 int i2c_test_repeated_read_write(uint i2c_num, uint i2c_dev_addr)
 {
     int     rc = 0;
@@ -266,6 +665,165 @@ int i2c_test_repeated_read_write(uint i2c_num, uint i2c_dev_addr)
     return rc;
 }
 
+#ifdef CONFIG_DEBUG_FS
+static int i2c_test_bench_show(struct seq_file *s, void *unused)
+{
+    u64 xfers;
+
+    mutex_lock(&bench_mutex);
+    if (!bench.valid) {
+        seq_puts(s, "no run yet\n");
+        mutex_unlock(&bench_mutex);
+        return 0;
+    }
+
+    xfers = bench.iterations - bench.errors;
+    seq_printf(s, "shape %s bus %u addr 0x%x size %u iterations %u errors %u\n",
+               i2c_test_bench_shapes[bench.shape], bench.bus, bench.addr,
+               bench.size, bench.iterations, bench.errors);
+    seq_printf(s, "elapsed %llu us, %llu transfers/s, %llu bytes/s\n",
+               div_u64(bench.elapsed_ns, NSEC_PER_USEC),
+               bench.elapsed_ns ? div64_u64(xfers * NSEC_PER_SEC, bench.elapsed_ns) : 0,
+               bench.elapsed_ns ? div64_u64(bench.bytes * NSEC_PER_SEC, bench.elapsed_ns) : 0);
+    seq_printf(s, "latency us: min %u p50 %u p90 %u p99 %u max %u\n",
+               bench.min_ns / 1000, bench.p50_ns / 1000, bench.p90_ns / 1000,
+               bench.p99_ns / 1000, bench.max_ns / 1000);
+    if (bench.shape == I2C_TEST_BENCH_WRITE)
+        seq_printf(s, "write cycle wait %llu us total\n",
+                   div_u64(bench.wait_ns, NSEC_PER_USEC));
+    mutex_unlock(&bench_mutex);
+
+    return 0;
+}
+
+static int i2c_test_bench_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, i2c_test_bench_show, NULL);
+}
+
+static ssize_t i2c_test_bench_write(struct file *file, const char __user *ubuf,
+                                    size_t count, loff_t *ppos)
+{
+    char    name[16];
+    size_t  len = min(count, sizeof(name) - 1);
+    int     shape, ret;
+
+    if (copy_from_user(name, ubuf, len))
+        return -EFAULT;
+    name[len] = '\0';
+
+    for (shape = 0; shape < I2C_TEST_BENCH_NR_SHAPES; shape++) {
+        if (sysfs_streq(name, i2c_test_bench_shapes[shape]))
+            break;
+    }
+    if (shape == I2C_TEST_BENCH_NR_SHAPES)
+        return -EINVAL;
+
+    mutex_lock(&bench_mutex);
+    ret = i2c_test_bench_run(shape);
+    mutex_unlock(&bench_mutex);
+
+    return ret ? ret : count;
+}
+
+static const struct file_operations i2c_test_bench_fops = {
+    .open       = i2c_test_bench_open,
+    .read       = seq_read,
+    .write      = i2c_test_bench_write,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+static ssize_t i2c_test_image_read(struct file *file, char __user *ubuf,
+                                   size_t count, loff_t *ppos)
+{
+    ssize_t ret;
+
+    mutex_lock(&eeprom_mutex);
+    ret = simple_read_from_buffer(ubuf, count, ppos, eeprom_image, I2C_TEST_EEPROM_SIZE);
+    mutex_unlock(&eeprom_mutex);
+
+    return ret;
+}
+
+static ssize_t i2c_test_image_write(struct file *file, const char __user *ubuf,
+                                    size_t count, loff_t *ppos)
+{
+    ssize_t ret;
+
+    mutex_lock(&eeprom_mutex);
+    ret = simple_write_to_buffer(eeprom_image, I2C_TEST_EEPROM_SIZE, ppos, ubuf, count);
+    mutex_unlock(&eeprom_mutex);
+
+    return ret;
+}
+
+static const struct file_operations i2c_test_image_fops = {
+    .read       = i2c_test_image_read,
+    .write      = i2c_test_image_write,
+    .llseek     = default_llseek,
+};
+
+static int i2c_test_eeprom_show(struct seq_file *s, void *unused)
+{
+    mutex_lock(&eeprom_mutex);
+    if (!eeprom_stats.valid) {
+        seq_puts(s, "no run yet\n");
+    } else if (!eeprom_stats.restore) {
+        seq_printf(s, "save %d, %llu us\n", eeprom_stats.result,
+                   div_u64(eeprom_stats.elapsed_ns, NSEC_PER_USEC));
+    } else {
+        seq_printf(s, "restore %d, %llu us (write %llu us, read back %llu us)\n",
+                   eeprom_stats.result,
+                   div_u64(eeprom_stats.elapsed_ns, NSEC_PER_USEC),
+                   div_u64(eeprom_stats.write_ns, NSEC_PER_USEC),
+                   div_u64(eeprom_stats.verify_ns, NSEC_PER_USEC));
+        seq_printf(s, "pages %u dirty %u written %u passes %u\n",
+                   eeprom_stats.pages, eeprom_stats.dirty,
+                   eeprom_stats.written, eeprom_stats.passes);
+    }
+    mutex_unlock(&eeprom_mutex);
+
+    return 0;
+}
+
+static int i2c_test_eeprom_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, i2c_test_eeprom_show, NULL);
+}
+
+static ssize_t i2c_test_eeprom_write(struct file *file, const char __user *ubuf,
+                                     size_t count, loff_t *ppos)
+{
+    char    cmd[16];
+    size_t  len = min(count, sizeof(cmd) - 1);
+    int     ret;
+
+    if (copy_from_user(cmd, ubuf, len))
+        return -EFAULT;
+    cmd[len] = '\0';
+
+    mutex_lock(&eeprom_mutex);
+    if (sysfs_streq(cmd, "save"))
+        ret = i2c_test_eeprom_run(false);
+    else if (sysfs_streq(cmd, "restore"))
+        ret = i2c_test_eeprom_run(true);
+    else
+        ret = -EINVAL;
+    mutex_unlock(&eeprom_mutex);
+
+    return ret ? ret : count;
+}
+
+static const struct file_operations i2c_test_eeprom_fops = {
+    .open       = i2c_test_eeprom_open,
+    .read       = seq_read,
+    .write      = i2c_test_eeprom_write,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+#endif
+
 static int __init i2c_test_init(void)
 {
 	printk(KERN_INFO "i2c_test init (i2c-bus = %d i2c-address = 0x%x): \n", i2c_num, i2c_dev_addr);
@@ -280,6 +838,9 @@ static int __init i2c_test_init(void)
 #ifdef CONFIG_DEBUG_FS
     debugfsdir = debugfs_create_dir("i2c_test", NULL);
     BUG_ON(IS_ERR(debugfsdir));
+    debugfs_create_file("bench", S_IRUSR | S_IWUSR, debugfsdir, NULL, &i2c_test_bench_fops);
+    debugfs_create_file("image", S_IRUSR | S_IWUSR, debugfsdir, NULL, &i2c_test_image_fops);
+    debugfs_create_file("eeprom", S_IRUSR | S_IWUSR, debugfsdir, NULL, &i2c_test_eeprom_fops);
 #endif
 
 	printk(KERN_INFO "i2c_test get adapter\n");
@@ -0,0 +1,382 @@
+/*
+ * Marvell Pegmatite SoC clock handling.
+ *
+ * Rate arithmetic shared by the pegmatite clock drivers.
+ *
+ * Everything here is pure integer math on rates and divider values, with no
+ * register or clock framework access, so that it also builds outside the
+ * kernel.  tools/ uses that to sweep rates, check the solvers and time
+ * them on a workstation.  Only the few kernel helpers used below are
+ * provided for that case.
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2.  This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+#ifndef __CLK_PEGMATITE_MATH_H
+#define __CLK_PEGMATITE_MATH_H
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/rational.h>
+#else
+#include <stdint.h>
+#include <limits.h>
+
+typedef uint64_t u64;
+typedef int64_t s64;
+
+#define abs64(x) ((x) < 0 ? -(x) : (x))
+
+static inline u64 div64_u64(u64 dividend, u64 divisor)
+{
+	return dividend / divisor;
+}
+
+static inline s64 div64_s64(s64 dividend, s64 divisor)
+{
+	return dividend / divisor;
+}
+
+/*
+ * lib/rational.c, built alongside by whoever includes this outside the kernel
+ */
+void rational_best_approximation(unsigned long given_numerator,
+				 unsigned long given_denominator,
+				 unsigned long max_numerator,
+				 unsigned long max_denominator,
+				 unsigned long *best_numerator,
+				 unsigned long *best_denominator);
+#endif
+
+/*
+ * Pll
+ */
+
+/*
+ * Output rate w/o any Frequency Offset.  Normally the vco runs at 4 times
+ * the feedback rate and the output is the vco divided by vcodiv.  In
+ * deskew mode the feedback is taken from the output (after the post
+ * divider), so the output runs at the feedback rate whatever vcodiv is.
+ */
+static inline unsigned int pegmatite_pll_calc_rate(unsigned long parent_rate,
+						   unsigned int refdiv, unsigned int fbdiv,
+						   unsigned int vcodiv, int deskew)
+{
+	if (deskew)
+		return (unsigned int)div64_u64((u64)parent_rate * fbdiv, refdiv);
+
+	return (unsigned int)div64_u64((u64)parent_rate * 4 * fbdiv, refdiv * vcodiv);
+}
+
+/*
+ * Post divider for the requested rate.  In deskew mode this is the largest
+ * power of 2 that keeps the vco at or below 3GHz, otherwise the smallest
+ * divider that puts the vco between 1GHz and 4GHz.
+ */
+static inline unsigned int pegmatite_pll_calc_vcodiv(unsigned long rate, int deskew)
+{
+	unsigned int vcodiv = 1;
+
+	if (deskew) {
+		if (rate > 0) {
+			while((unsigned long long)rate * vcodiv <= 3000000000ull) {
+				vcodiv *= 2;
+			}
+			vcodiv /= 2;
+		}
+	}
+	else {
+		while(((unsigned long long)rate * vcodiv < 1000000000ull) ||
+			  ((unsigned long long)rate * vcodiv > 4000000000ull)) {
+			vcodiv++;
+		}
+	}
+
+	return vcodiv;
+}
+
+/*
+ * Feedback divider for a vco rate and a divided reference rate (frefdiv)
+ */
+static inline unsigned int pegmatite_pll_calc_fbdiv(unsigned int fvco, unsigned int frefdiv,
+						    unsigned int vcodiv, int deskew)
+{
+	if (deskew)
+		return fvco / (frefdiv * vcodiv);
+
+	return (fvco / 4) / frefdiv;
+}
+
+/*
+ * Reference divider for the requested rate.  Start from the smallest one
+ * that brings the divided reference down to 32MHz, then try every divider
+ * that keeps it at 8MHz or more, and keep the one whose output (w/o any
+ * Frequency Offset) comes closest to rate.
+ */
+static inline unsigned int pegmatite_pll_best_refdiv(unsigned long rate, unsigned long parent_rate,
+						     unsigned int vcodiv, int deskew)
+{
+	unsigned int fvco = rate * vcodiv;
+	unsigned int refdiv = 1;
+	unsigned int best_refdiv;
+	unsigned int fbdiv;
+	unsigned int calc_rate;
+	unsigned int best_calc_rate;
+
+	while(parent_rate/refdiv > 32000000) {
+		refdiv++;
+	}
+	best_refdiv = refdiv;
+
+	fbdiv = pegmatite_pll_calc_fbdiv(fvco, parent_rate / refdiv, vcodiv, deskew);
+	best_calc_rate = pegmatite_pll_calc_rate(parent_rate, refdiv, fbdiv, vcodiv, deskew);
+
+	for(refdiv++; parent_rate/refdiv >= 8000000; refdiv++) {
+		fbdiv = pegmatite_pll_calc_fbdiv(fvco, parent_rate / refdiv, vcodiv, deskew);
+		calc_rate = pegmatite_pll_calc_rate(parent_rate, refdiv, fbdiv, vcodiv, deskew);
+		if(abs64((s64)best_calc_rate - (s64)rate) > abs64((s64)calc_rate - (s64)rate)) {
+			best_refdiv = refdiv;
+			best_calc_rate = calc_rate;
+		}
+	}
+
+	return best_refdiv;
+}
+
+/*
+ * Can the Frequency Offset (+/- 5%) take calc_rate to ref?
+ */
+static inline int pegmatite_pll_offset_reachable(s64 calc_rate, s64 ref)
+{
+	s64 offset_percent;
+
+	/*
+	 * Since we can't do any floating point math in the kernel, multiply by 100000000
+	 */
+	offset_percent = div64_s64((calc_rate - ref) * 100000000, ref);
+
+	return abs64(offset_percent) <= 5000000;
+}
+
+/*
+ * Offset percent is calculated by (calc_rate - ref) / ref, where ref is the
+ * requested output rate (not the vco rate)
+ * The formula to calculate freq_offset is freq_offset[15:0] = 2^20 * (abs(offset_percent) / (1 + offset_percent))
+ * Since 1 + offset_percent = calc_rate / ref, that is 2^20 * abs(calc_rate - ref) / calc_rate
+ */
+static inline unsigned int pegmatite_pll_calc_freq_offset(s64 calc_rate, s64 ref)
+{
+	unsigned int freq_offset;
+	u64 diff;
+
+	/*
+	 * Bit 17 of freq_offset is the sign of the offset percentage
+	 */
+	if(calc_rate > ref) {
+		freq_offset = 0;
+		diff = calc_rate - ref;
+	} else {
+		freq_offset = 0x10000;
+		diff = ref - calc_rate;
+	}
+
+	/*
+	 * Multiply by 2^20 and divide by calc_rate, rounding to the nearest step
+	 */
+	diff = div64_u64(diff * 1048576 + calc_rate / 2, calc_rate);
+
+	freq_offset |= 0xffff & (unsigned int)diff;
+
+	return freq_offset;
+}
+
+/*
+ * Frequency Offset that takes calc_rate to rate, as set_rate and retune
+ * program it, or 0 when none is needed or the +/- 5% can't cover it
+ */
+static inline unsigned int pegmatite_pll_rate_offset(unsigned int calc_rate,
+						     unsigned long rate, int deskew)
+{
+	if(calc_rate == rate || deskew || !pegmatite_pll_offset_reachable(calc_rate, rate))
+		return 0;
+
+	return pegmatite_pll_calc_freq_offset(calc_rate, rate);
+}
+
+/*
+ * The rate set_rate gets closest to: the output rate of the dividers it
+ * picks, or the requested rate itself when the Frequency Offset can make
+ * up the difference.
+ */
+static inline unsigned long pegmatite_pll_calc_round_rate(unsigned long rate,
+							  unsigned long parent_rate,
+							  int deskew)
+{
+	unsigned int vcodiv, fvco, refdiv, fbdiv;
+	unsigned int calc_rate;
+
+	vcodiv = pegmatite_pll_calc_vcodiv(rate, deskew);
+	fvco = rate * vcodiv;
+	refdiv = pegmatite_pll_best_refdiv(rate, parent_rate, vcodiv, deskew);
+	fbdiv = pegmatite_pll_calc_fbdiv(fvco, parent_rate / refdiv, vcodiv, deskew);
+
+	calc_rate = pegmatite_pll_calc_rate(parent_rate, refdiv, fbdiv, vcodiv, deskew);
+
+	if(pegmatite_pll_rate_offset(calc_rate, rate, deskew))
+		return rate;
+
+	return calc_rate;
+}
+
+/*
+ * If there is a Frequency Offset value, determine the rate it moves the calculated clock rate to
+ * The formula to calculate freq_offset is freq_offset[15:0] = 2^20 * (abs(offset_percent) / (1 + offset_percent))
+ * which is 2^20 * abs(calc_rate - ref) / calc_rate, so the offset rate is calc_rate +/- calc_rate * freq_offset[15:0] / 2^20
+ */
+static inline unsigned int pegmatite_pll_apply_freq_offset(unsigned int calc_rate,
+							   unsigned int freq_offset)
+{
+	s64 freq_bump;
+
+	if(!freq_offset)
+		return calc_rate;
+
+	/*
+	 * Scale the calculated rate by the first 16 bits of freq_offset over 2^20
+	 */
+	freq_bump = div64_s64((s64)calc_rate * (freq_offset & 0xffff) + 524288, 1048576);
+
+	/*
+	 * Bit 17 of freq_offset is the sign of the offset percentage
+	 */
+	if(freq_offset & 0x10000) {
+		calc_rate += freq_bump;
+	} else {
+		calc_rate -= freq_bump;
+	}
+
+	return calc_rate;
+}
+
+/*
+ * Fractional divider
+ */
+#define PEGMATITE_CLKFD_MAX	0xffff
+
+/*
+ * outfreq = infreq * D / (2 * N)
+ *
+ * So D / N has to approximate 2 * outfreq / infreq with both D and N limited
+ * to 16 bits, which is what rational_best_approximation() does.  Halve both
+ * terms if doubling the rate wouldn't fit in an unsigned long.
+ */
+static inline void pegmatite_clkfd_best_ratio(unsigned long rate, unsigned long parent_rate,
+					      unsigned int *denom, unsigned int *num)
+{
+	unsigned long d, n;
+
+	if (rate > ULONG_MAX / 2)
+		parent_rate /= 2;
+	else
+		rate *= 2;
+
+	rational_best_approximation(rate, parent_rate, PEGMATITE_CLKFD_MAX,
+				    PEGMATITE_CLKFD_MAX, &d, &n);
+
+	*denom = (unsigned int)d;
+	*num = (unsigned int)n;
+}
+
+/*
+ * Work out the numerator/denominator for the requested rate and return the
+ * rate they actually produce.  Shared by round_rate and set_rate so both
+ * always agree.
+ */
+static inline unsigned long pegmatite_clkfd_calc(unsigned long rate, unsigned long parent_rate,
+						 unsigned int *num, unsigned int *denom)
+{
+	/*
+	 * The divider can't go faster than the parent (and a 2:1 ratio
+	 * is the reset value), so fall back to that
+	 */
+	if (!rate || parent_rate <= rate) {
+		*num = 0x8000;
+		*denom = 0x8000;
+		return parent_rate / 2;
+	}
+
+	pegmatite_clkfd_best_ratio(rate, parent_rate, denom, num);
+
+	/*
+	 * Rates too slow to represent at all get the slowest setting
+	 */
+	if (*denom == 0 || *num == 0) {
+		*denom = 1;
+		*num = PEGMATITE_CLKFD_MAX;
+	}
+
+	return (unsigned long)div64_u64(((u64)parent_rate * *denom), (2 * *num));
+}
+
+/*
+ * Lvdsafe divider
+ */
+#define PEGMATITE_LVDSAFE_MIN_DIV	2
+#define PEGMATITE_LVDSAFE_MAX_DIV	512	/* hidiv + 1 + lodiv + 1 */
+
+/*
+ * Total (hi + lo) divide closest to the requested rate.  Shared by
+ * round_rate and set_rate.
+ */
+static inline unsigned int pegmatite_clklvdsafe_calc_div(unsigned long rate,
+							 unsigned long parent_rate)
+{
+	unsigned int totaldiv;
+
+	totaldiv = parent_rate / rate;
+	if (totaldiv < PEGMATITE_LVDSAFE_MIN_DIV)
+		totaldiv = PEGMATITE_LVDSAFE_MIN_DIV;
+	if (totaldiv > PEGMATITE_LVDSAFE_MAX_DIV)
+		totaldiv = PEGMATITE_LVDSAFE_MAX_DIV;
+	/* if we aren't going over, check if the next divider is closer */
+	if ((totaldiv < PEGMATITE_LVDSAFE_MAX_DIV) &&
+		(abs64((s64)rate - (s64)(parent_rate / totaldiv)) >
+		 abs64((s64)rate - (s64)(parent_rate / (totaldiv + 1)))))
+	{
+		totaldiv++;
+	}
+
+	return totaldiv;
+}
+
+/*
+ * Off-chip factor clock
+ */
+
+/*
+ * Multiplier closest to the requested rate, never below 1
+ */
+static inline unsigned int pegmatite_oc_factor_calc_mult(unsigned long rate,
+							 unsigned long parent_rate)
+{
+	unsigned int mult;
+
+	if (rate < parent_rate) {
+		return 1;
+	}
+
+	mult = rate / parent_rate;
+	if (rate % parent_rate)
+	{
+		if (abs64((s64)rate - (s64)parent_rate * mult) >
+			abs64((s64)rate - (s64)parent_rate * (mult + 1))) {
+			mult++;
+		}
+	}
+
+	return mult;
+}
+
+#endif /* __CLK_PEGMATITE_MATH_H */
@@ -0,0 +1,89 @@
+/*
+ * Marvell Pegmatite SoC clock handling.
+ *
+ * Tracepoints for pegmatite clock rate changes
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2.  This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pegmatite_clk
+
+#if !defined(_CLK_PEGMATITE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CLK_PEGMATITE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * One set_rate of one clock, with the time spent in each phase
+ */
+TRACE_EVENT(pegmatite_clk_set_rate,
+
+	TP_PROTO(const char *name, unsigned long rate, u64 solve_ns,
+		 u64 bypass_ns, u64 program_ns, u64 lock_ns),
+
+	TP_ARGS(name, rate, solve_ns, bypass_ns, program_ns, lock_ns),
+
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(unsigned long, rate)
+		__field(u64, solve_ns)
+		__field(u64, bypass_ns)
+		__field(u64, program_ns)
+		__field(u64, lock_ns)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->rate = rate;
+		__entry->solve_ns = solve_ns;
+		__entry->bypass_ns = bypass_ns;
+		__entry->program_ns = program_ns;
+		__entry->lock_ns = lock_ns;
+	),
+
+	TP_printk("%s rate=%lu solve=%llu bypass=%llu program=%llu lock=%llu",
+		  __get_str(name), __entry->rate, __entry->solve_ns,
+		  __entry->bypass_ns, __entry->program_ns, __entry->lock_ns)
+);
+
+/*
+ * A whole rate change, from the first pre-change notification in the
+ * affected subtree to the last post-change one
+ */
+TRACE_EVENT(pegmatite_clk_transition,
+
+	TP_PROTO(const char *name, unsigned long old_rate, unsigned long new_rate,
+		 u64 total_ns, unsigned int num_clks),
+
+	TP_ARGS(name, old_rate, new_rate, total_ns, num_clks),
+
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(unsigned long, old_rate)
+		__field(unsigned long, new_rate)
+		__field(u64, total_ns)
+		__field(unsigned int, num_clks)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->old_rate = old_rate;
+		__entry->new_rate = new_rate;
+		__entry->total_ns = total_ns;
+		__entry->num_clks = num_clks;
+	),
+
+	TP_printk("%s %lu -> %lu total=%llu clks=%u",
+		  __get_str(name), __entry->old_rate, __entry->new_rate,
+		  __entry->total_ns, __entry->num_clks)
+);
+
+#endif /* _CLK_PEGMATITE_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE clk-pegmatite-trace
+#include <trace/define_trace.h>
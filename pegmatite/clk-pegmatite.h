@@ -0,0 +1,170 @@
+/*
+ * Marvell Pegmatite SoC clock handling.
+ *
+ * Shared definitions for the pegmatite clock drivers.
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2.  This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+#ifndef __CLK_PEGMATITE_H
+#define __CLK_PEGMATITE_H
+
+#include <linux/clk-provider.h>
+#include <linux/io.h>
+#include <linux/bitops.h>
+
+extern const struct clk_ops pegmatite_pll_ops;
+extern const struct clk_ops pegmatite_clkgen_ops;
+extern const struct clk_ops pegmatite_clkfd_ops;
+extern const struct clk_ops pegmatite_oc_factor_ops;
+
+/*
+ * Boot-time clock plan (clkplan.c)
+ *
+ * Every pll registers itself, and every clock with a clock-frequency
+ * property hands its default rate over instead of calling clk_set_rate()
+ * directly.  Without a marvell,pegmatite-clkplan node the rate is applied
+ * immediately, as before.
+ */
+void pegmatite_clk_plan_add_pll(struct clk_hw *hw, unsigned long rate);
+void pegmatite_clk_plan_add(struct clk_hw *hw, const struct clk_ops *ops,
+			    unsigned long rate);
+
+/*
+ * Pll lock wait (pll.c)
+ *
+ * Between pegmatite_pll_defer_lock(true) and (false), pll set_rate programs
+ * the pll and leaves it in bypass without waiting for lock.
+ * pegmatite_pll_wait_pending() then waits for all of them at once.
+ * Plls marked critical in the device tree always wait in set_rate.
+ */
+void pegmatite_pll_defer_lock(bool defer);
+void pegmatite_pll_wait_pending(void);
+void __pegmatite_pll_wait_pending(void);	/* caller excludes set_rate */
+
+/*
+ * Rate change statistics (clkstats.c)
+ *
+ * set_rate calls pegmatite_clk_stats_start() on entry, marks the end of each
+ * phase it goes through with pegmatite_clk_stats_phase() and finishes with
+ * pegmatite_clk_stats_end().  All of them accept a NULL stats pointer.
+ */
+enum pegmatite_clk_phase {
+	PEGMATITE_CLK_SOLVE,		/* working out the register values */
+	PEGMATITE_CLK_BYPASS,		/* bypass and reset before programming */
+	PEGMATITE_CLK_PROGRAM,		/* register writes */
+	PEGMATITE_CLK_LOCK,		/* waiting for lock */
+	PEGMATITE_CLK_NR_PHASES,
+};
+
+struct pegmatite_clk_stats;
+
+struct pegmatite_clk_stats *pegmatite_clk_stats_register(struct clk_hw *hw);
+void pegmatite_clk_stats_start(struct pegmatite_clk_stats *stats);
+void pegmatite_clk_stats_phase(struct pegmatite_clk_stats *stats,
+			       enum pegmatite_clk_phase phase);
+void pegmatite_clk_stats_end(struct pegmatite_clk_stats *stats, unsigned long rate);
+
+/*
+ * Register save and restore across suspend (clkpm.c)
+ *
+ * At resume the stages are restored in order, and the plls' locks are
+ * waited for together at the end of the pll stage, so a pll resume only
+ * programs the pll and leaves it pending.  Runs with interrupts off.
+ */
+enum pegmatite_clk_pm_stage {
+	PEGMATITE_CLK_PM_PLL,
+	PEGMATITE_CLK_PM_SSCG,
+	PEGMATITE_CLK_PM_DIV,
+	PEGMATITE_CLK_PM_GATE,
+	PEGMATITE_CLK_PM_NR_STAGES,
+};
+
+void pegmatite_clk_pm_register(struct clk_hw *hw, enum pegmatite_clk_pm_stage stage,
+			       void (*suspend)(struct clk_hw *hw),
+			       void (*resume)(struct clk_hw *hw));
+
+/*
+ * Shadow copy of a clock's registers
+ *
+ * The clock registers sit on a slow bus and only change when we write them,
+ * so they are read once when the cache is filled and every later read is
+ * served from memory.  Writes go to both.  Registers the hardware updates
+ * on its own (e.g. pll lock status) must be read directly instead, or be
+ * marked read-only: those are never written back, and the driver refreshes
+ * them after the writes that change them.
+ */
+#define PEGMATITE_REGCACHE_MAX	11
+
+struct pegmatite_regcache {
+	void __iomem	*base;
+	unsigned int	num_regs;
+	bool		valid;
+	u32		ro_mask;	/* registers the hardware owns */
+	u32		vals[PEGMATITE_REGCACHE_MAX];
+};
+
+static inline void pegmatite_regcache_init(struct pegmatite_regcache *cache,
+					   void __iomem *base, unsigned int num_regs)
+{
+	cache->base = base;
+	cache->num_regs = min_t(unsigned int, num_regs, PEGMATITE_REGCACHE_MAX);
+	cache->valid = false;
+	cache->ro_mask = 0;
+}
+
+static inline void pegmatite_regcache_set_readonly(struct pegmatite_regcache *cache,
+						   unsigned int offset)
+{
+	cache->ro_mask |= BIT(offset / 4);
+}
+
+static inline void pegmatite_regcache_fill(struct pegmatite_regcache *cache)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->num_regs; i++)
+		cache->vals[i] = readl(cache->base + i * 4);
+	cache->valid = true;
+}
+
+/*
+ * Write the whole image back, e.g. after the registers lost their state.
+ * Read-only registers are left alone.
+ */
+static inline void pegmatite_regcache_restore(struct pegmatite_regcache *cache)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->num_regs; i++)
+		if (!(cache->ro_mask & BIT(i)))
+			writel_relaxed(cache->vals[i], cache->base + i * 4);
+	wmb();
+}
+
+/*
+ * Read one register back into the cache, for read-only registers after a
+ * write that changes them
+ */
+static inline u32 pegmatite_regcache_refresh(struct pegmatite_regcache *cache,
+					     unsigned int offset)
+{
+	cache->vals[offset / 4] = readl(cache->base + offset);
+	return cache->vals[offset / 4];
+}
+
+static inline u32 pegmatite_regcache_read(struct pegmatite_regcache *cache,
+					  unsigned int offset)
+{
+	return cache->vals[offset / 4];
+}
+
+static inline void pegmatite_regcache_write(struct pegmatite_regcache *cache,
+					    u32 val, unsigned int offset)
+{
+	cache->vals[offset / 4] = val;
+	writel(val, cache->base + offset);
+}
+
+#endif /* __CLK_PEGMATITE_H */
@@ -16,6 +16,9 @@
 #include <linux/io.h>
 #include <linux/math64.h>
 
+#include "clk-pegmatite.h"
+#include "clk-pegmatite-math.h"
+
 /*
  * The fraction divider applies only to the UART clocks.  It allows the user
  * to create an arbitrary numerator and denominator to generate very specific
@@ -23,13 +26,16 @@
  */
 #define FD_NUM_SHIFT 16
 #define FD_MASK 0xffff
+#define FD_CONFIG 0x8
 
 #define to_pegmatite_clkfd(_hw) container_of(_hw, struct pegmatite_clkfd, hw)
 struct pegmatite_clkfd {
 	struct clk_hw		hw;
 	void __iomem		*config;
+	struct pegmatite_regcache cache;
 	unsigned int		num;
 	unsigned int		denom;
+	struct pegmatite_clk_stats *stats;
 };
 
 static unsigned long pegmatite_clkfd_recalc_rate(struct clk_hw *hw, unsigned long parent_rate)
@@ -37,7 +43,7 @@ static unsigned long pegmatite_clkfd_recalc_rate(struct clk_hw *hw, unsigned lon
 	struct pegmatite_clkfd *gen = to_pegmatite_clkfd(hw);
 	unsigned long rate;
 	u32 num, denom;
-	u32 val = readl(gen->config + 8);
+	u32 val = pegmatite_regcache_read(&gen->cache, 0);
 
 	num = (val >> FD_NUM_SHIFT) & FD_MASK;
 	denom = val & FD_MASK;
@@ -50,75 +56,33 @@ static unsigned long pegmatite_clkfd_recalc_rate(struct clk_hw *hw, unsigned lon
 static int pegmatite_clkfd_set_rate(struct clk_hw *hw, unsigned long rate, unsigned long parent_rate)
 {
 	struct pegmatite_clkfd *gen = to_pegmatite_clkfd(hw);
-	int val = 0x80008000;
-
-	if (parent_rate > rate) {
-		uint64_t a = parent_rate;
-		unsigned int num, tmp, denom = 1;
-
-		/*
-		 * outfreq = infreq * D / (2 * N)
-		 *
-		 * This approximates a 16 bit numerator and denominator from below by
-		 * proportionally multiplying the infreq by 2 and the denominator by
-		 * 2 until numerator/outfreq uses all 16 bits.
-		 */
-		num = tmp = (unsigned int)div64_ul(a, rate);
-		while ((tmp & ~0xffff) == 0) {
-			num = tmp;
-			a <<= 1;
-			denom <<= 1;
-			tmp = (unsigned int)div64_ul(a, rate);
-		}
-
-		/*
-		 * The calculated divisor is an approximation from below so the
-		 * resulting outfreq is too fast.  Reign it in by incrementing the
-		 * numerator until the outfreq is <= the requested rate.
-		 */
-		tmp = (unsigned int)div64_ul(((u64)parent_rate * denom), (2 * num));
-		while (tmp > rate) {
-			if (num>= 0xffff)
-				break;
-			++num;
-			tmp = (unsigned int)div64_ul(((u64)parent_rate * denom), (2 * num));
-		}
-
-		val = num << FD_NUM_SHIFT;
-		val |= (denom & FD_MASK);
-	}
+	unsigned int num, denom;
+	u32 val;
+
+	pegmatite_clk_stats_start(gen->stats);
+	pegmatite_clkfd_calc(rate, parent_rate, &num, &denom);
+
+	val = (num & FD_MASK) << FD_NUM_SHIFT;
+	val |= (denom & FD_MASK);
+	pegmatite_clk_stats_phase(gen->stats, PEGMATITE_CLK_SOLVE);
 
-	writel(val, gen->config + 8);
+	pegmatite_regcache_write(&gen->cache, val, 0);
+	pegmatite_clk_stats_phase(gen->stats, PEGMATITE_CLK_PROGRAM);
+	pegmatite_clk_stats_end(gen->stats, rate);
 
 	return 0;
 }
 
-static long pegmatite_clkfd_round_rate(struct clk_hw *hw, unsigned long rate, unsigned long *prate)
+static void pegmatite_clkfd_resume(struct clk_hw *hw)
 {
-	unsigned long calc_rate = *prate;
-	uint64_t a = *prate;
-	unsigned int num, tmp, denom = 1;
-
-	/*
-	 * See comments in set_rate for questions
-	 */
-	num = tmp = (unsigned int)div64_ul(a, rate);
-	while ((tmp & ~0xffff) == 0) {
-		num = tmp;
-		a <<= 1;
-		denom <<= 1;
-		tmp = (unsigned int)div64_ul(a, rate);
-	}
+	pegmatite_regcache_restore(&to_pegmatite_clkfd(hw)->cache);
+}
 
-	calc_rate = div64_ul((*prate * (u64)denom), (2 * num));
-	while (calc_rate > rate) {
-		if (num>= 0xffff)
-			break;
-		++num;
-		calc_rate = div64_ul((*prate * (u64)denom), (2 * num));
-	}
+static long pegmatite_clkfd_round_rate(struct clk_hw *hw, unsigned long rate, unsigned long *prate)
+{
+	unsigned int num, denom;
 
-	return calc_rate;
+	return pegmatite_clkfd_calc(rate, *prate, &num, &denom);
 }
 
 const struct clk_ops pegmatite_clkfd_ops = {
@@ -170,19 +134,23 @@ static void __init of_pegmatite_clkfd_setup(struct device_node *node)
 
 	gen->hw.init = init;
 	gen->config = clk_base;
+	pegmatite_regcache_init(&gen->cache, clk_base + FD_CONFIG, 1);
+	pegmatite_regcache_fill(&gen->cache);
 
 	clk = clk_register(NULL, &gen->hw);
 	if(WARN_ON(IS_ERR(clk)))
 		goto map_out;
 
 	of_clk_add_provider(node, of_clk_src_simple_get, clk);
+	gen->stats = pegmatite_clk_stats_register(&gen->hw);
+	pegmatite_clk_pm_register(&gen->hw, PEGMATITE_CLK_PM_DIV, NULL, pegmatite_clkfd_resume);
 
 	/*
-	 * If a default rate was specified in the device tree, set it here
+	 * If a default rate was specified in the device tree, hand it to the
+	 * clock plan, which sets it here unless a plan is in use
 	 * If this clock can be gated, setting the default rate does not ungate it
 	 */
-	if(default_rate > 0)
-		clk_set_rate(clk, default_rate);
+	pegmatite_clk_plan_add(&gen->hw, &pegmatite_clkfd_ops, default_rate);
 
 	return;
 map_out:
@@ -13,6 +13,13 @@
 #include <linux/of_address.h>
 #include <linux/of.h>
 #include <linux/io.h>
+#include <linux/delay.h>
+#include <linux/slab.h>
+#include <linux/llist.h>
+#include <linux/bitops.h>
+#include <linux/workqueue.h>
+
+#include "clk-pegmatite.h"
 
 #define CLK_EN_MASK 2
 #define CLK_RESET_MASK 1
@@ -26,11 +33,124 @@ struct pegmatite_clkgate {
 	struct clk_hw	hw;
 	void __iomem	*config;
 	int		reset;
+	unsigned long	verify_pending;
+	struct llist_node verify_node;
+	bool		batched;	/* written by the current group operation */
+	u32		saved;		/* config at suspend */
+};
+
+/*
+ * A gate group turns a set of gates on or off in one clock operation.  The
+ * members are listed in the group's clocks property, in the order they are
+ * to be enabled; they are disabled in the reverse order.  The members are
+ * driven through the clock framework, so a gate shared with other users or
+ * other groups only goes off when the last of them lets go.  The gates the
+ * framework does switch are written relaxed and posted with one barrier for
+ * the whole group, and on enable their status is polled once for the group.
+ */
+#define to_pegmatite_clkgate_group(_hw) container_of(_hw, struct pegmatite_clkgate_group, hw)
+struct pegmatite_clkgate_group {
+	struct clk_hw		hw;
+	unsigned int		num_gates;
+	struct clk		**clks;
+	struct pegmatite_clkgate **gates;
 };
 
 static bool debug_clkdisable;
 module_param(debug_clkdisable, bool, 0644);
 
+/*
+ * With debug_clkdisable set, disabled gates are queued and their status
+ * registers are checked later from a work item, so the disable itself
+ * doesn't wait on a slow status read.  Checks and failures are counted.
+ */
+#define CLKDISABLE_VERIFY_DELAY_MS	10
+
+static unsigned int clkdisable_checked;
+module_param(clkdisable_checked, uint, 0444);
+static unsigned int clkdisable_failed;
+module_param(clkdisable_failed, uint, 0444);
+
+static LLIST_HEAD(clkdisable_verify_list);
+
+static void pegmatite_clkgate_verify_disable(struct pegmatite_clkgate *gate)
+{
+	u32 val = readl(gate->config + CLK_STATUS_OFFSET);
+
+	clkdisable_checked++;
+	if (!(val & CLK_STATUS_SUCCESS_MASK)) {
+		clkdisable_failed++;
+		pr_err_ratelimited("pegmatite clock %s@%pK disable failed. Status = 0x%x\n",
+				   __clk_get_name(gate->hw.clk), gate->config, val);
+	}
+}
+
+static void pegmatite_clkgate_verify_work(struct work_struct *work)
+{
+	struct pegmatite_clkgate *gate, *tmp;
+	struct llist_node *list;
+
+	list = llist_del_all(&clkdisable_verify_list);
+	llist_for_each_entry_safe(gate, tmp, list, verify_node) {
+		clear_bit(0, &gate->verify_pending);
+
+		/*
+		 * Re-enabled since, so the status is no longer about the disable
+		 */
+		if (readl(gate->config) & CLK_EN_MASK)
+			continue;
+
+		pegmatite_clkgate_verify_disable(gate);
+	}
+}
+
+static DECLARE_DELAYED_WORK(clkdisable_verify_work, pegmatite_clkgate_verify_work);
+
+/*
+ * Called with the clock enable lock held, so only queue the gate.  A gate
+ * already queued isn't added again.
+ */
+static void pegmatite_clkgate_queue_verify(struct pegmatite_clkgate *gate)
+{
+	if (!debug_clkdisable)
+		return;
+
+	/*
+	 * Too early for the workqueue, check it now
+	 */
+	if (!keventd_up()) {
+		pegmatite_clkgate_verify_disable(gate);
+		return;
+	}
+
+	if (test_and_set_bit(0, &gate->verify_pending))
+		return;
+
+	llist_add(&gate->verify_node, &clkdisable_verify_list);
+	schedule_delayed_work(&clkdisable_verify_work,
+			      msecs_to_jiffies(CLKDISABLE_VERIFY_DELAY_MS));
+}
+
+/*
+ * Set by a group around the enables or disables of its members.  Those run
+ * under the clock enable lock, so no other gate operation sees it.
+ */
+static bool clkgate_batching;
+
+/*
+ * Write the config register.  Within a group operation the write is relaxed
+ * and the gate is marked, and the group issues the barrier.
+ */
+static void pegmatite_clkgate_write(struct pegmatite_clkgate *gate, u32 val)
+{
+	if (clkgate_batching) {
+		writel_relaxed(val, gate->config);
+		gate->batched = true;
+	} else {
+		writel(val, gate->config);
+	}
+}
+
 static int pegmatite_clkgate_is_enabled(struct clk_hw *hw)
 {
 	struct pegmatite_clkgate *gate = to_pegmatite_clkgate(hw);
@@ -61,14 +181,14 @@ static int pegmatite_clkgate_enable(struct clk_hw *hw)
 	 * Set the enable bit
 	 */
 	val |= CLK_EN_MASK;
-	writel(val, gate->config);
+	pegmatite_clkgate_write(gate, val);
 
 	/*
 	 * If this is a clock with a reset, set that too
 	 */
 	if(gate->reset) {
 		val |= CLK_RESET_MASK;
-		writel(val, gate->config);
+		pegmatite_clkgate_write(gate, val);
 	}
 
 	return 0;
@@ -77,27 +197,43 @@ static int pegmatite_clkgate_enable(struct clk_hw *hw)
 static void pegmatite_clkgate_disable(struct clk_hw *hw)
 {
 	struct pegmatite_clkgate *gate = to_pegmatite_clkgate(hw);
-	int val = readl(gate->config);
+	int val;
+
+	val = readl(gate->config);
 
 	/*
 	 * If this is a clock with a reset, clear it first
 	 */
 	if(gate->reset) {
 		val &= ~CLK_RESET_MASK;
-		writel(val, gate->config);
+		pegmatite_clkgate_write(gate, val);
 	}
 
 	/*
 	 * Clear the enable bit
 	 */
 	val &= ~CLK_EN_MASK;
-	writel(val, gate->config);
-	if (debug_clkdisable) {
-		val = readl(gate->config + CLK_STATUS_OFFSET);
-		WARN(!(val & CLK_STATUS_SUCCESS_MASK),
-		     "pegmatite clock %s@%pK disable failed. Status = 0x%x",
-		     __clk_get_name(hw->clk), gate->config, val);
-	}
+	pegmatite_clkgate_write(gate, val);
+	pegmatite_clkgate_queue_verify(gate);
+}
+
+static void pegmatite_clkgate_suspend(struct clk_hw *hw)
+{
+	struct pegmatite_clkgate *gate = to_pegmatite_clkgate(hw);
+
+	gate->saved = readl(gate->config);
+}
+
+/*
+ * Enable before releasing the reset, as in enable
+ */
+static void pegmatite_clkgate_resume(struct clk_hw *hw)
+{
+	struct pegmatite_clkgate *gate = to_pegmatite_clkgate(hw);
+
+	if (gate->reset && (gate->saved & CLK_RESET_MASK))
+		writel_relaxed(gate->saved & ~CLK_RESET_MASK, gate->config);
+	writel_relaxed(gate->saved, gate->config);
 }
 
 const struct clk_ops pegmatite_clkgate_ops = {
@@ -160,6 +296,9 @@ static void __init of_pegmatite_clkgate_setup(struct device_node *node)
 		clk_prepare_enable(clk);
 	}
 
+	pegmatite_clk_pm_register(&gate->hw, PEGMATITE_CLK_PM_GATE,
+				  pegmatite_clkgate_suspend, pegmatite_clkgate_resume);
+
 	of_clk_add_provider(node, of_clk_src_simple_get, clk);
 
 	return;
@@ -172,3 +311,221 @@ free_out:
 }
 
 CLK_OF_DECLARE(pegmatite_clkgate, "marvell,pegmatite-clkgate", of_pegmatite_clkgate_setup);
+
+static int pegmatite_clkgate_group_prepare(struct clk_hw *hw)
+{
+	struct pegmatite_clkgate_group *group = to_pegmatite_clkgate_group(hw);
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < group->num_gates; i++) {
+		ret = clk_prepare(group->clks[i]);
+		if (ret)
+			goto unprepare;
+	}
+
+	return 0;
+unprepare:
+	while (i--)
+		clk_unprepare(group->clks[i]);
+	return ret;
+}
+
+static void pegmatite_clkgate_group_unprepare(struct clk_hw *hw)
+{
+	struct pegmatite_clkgate_group *group = to_pegmatite_clkgate_group(hw);
+	unsigned int i = group->num_gates;
+
+	while (i--)
+		clk_unprepare(group->clks[i]);
+}
+
+/*
+ * Poll the status of every member the group switched on, once for the whole
+ * group, until they all report success
+ */
+#define CLKGATE_GROUP_POLL_US	100
+
+static int pegmatite_clkgate_group_wait(struct pegmatite_clkgate_group *group)
+{
+	struct pegmatite_clkgate *gate;
+	unsigned int i, pending, us;
+	u32 val;
+
+	for (us = 0; ; us++) {
+		pending = 0;
+		for (i = 0; i < group->num_gates; i++) {
+			gate = group->gates[i];
+			if (!gate->batched)
+				continue;
+
+			val = readl_relaxed(gate->config + CLK_STATUS_OFFSET);
+			if (val & CLK_STATUS_FAIL_MASK) {
+				pr_err("pegmatite clock %s@%pK enable in group %s failed. Status = 0x%x\n",
+				       __clk_get_name(group->clks[i]), gate->config,
+				       __clk_get_name(group->hw.clk), val);
+				return -EIO;
+			}
+			if (val & CLK_STATUS_SUCCESS_MASK)
+				gate->batched = false;
+			else
+				pending++;
+		}
+
+		if (!pending)
+			return 0;
+		if (us == CLKGATE_GROUP_POLL_US)
+			break;
+		udelay(1);
+	}
+
+	pr_err("pegmatite clock group %s: %u members not enabled after %u us\n",
+	       __clk_get_name(group->hw.clk), pending, CLKGATE_GROUP_POLL_US);
+	return -ETIMEDOUT;
+}
+
+static int pegmatite_clkgate_group_enable(struct clk_hw *hw)
+{
+	struct pegmatite_clkgate_group *group = to_pegmatite_clkgate_group(hw);
+	unsigned int i, n;
+	int ret = 0;
+
+	/*
+	 * The framework only calls enable on members that were off; those
+	 * are written relaxed and marked
+	 */
+	clkgate_batching = true;
+	for (n = 0; n < group->num_gates; n++) {
+		ret = clk_enable(group->clks[n]);
+		if (ret)
+			break;
+	}
+	clkgate_batching = false;
+
+	/*
+	 * One barrier posts the enable and reset writes of all the members
+	 */
+	wmb();
+
+	if (!ret)
+		ret = pegmatite_clkgate_group_wait(group);
+	if (!ret)
+		return 0;
+
+	for (i = 0; i < group->num_gates; i++)
+		group->gates[i]->batched = false;
+	while (n--)
+		clk_disable(group->clks[n]);
+	return ret;
+}
+
+static void pegmatite_clkgate_group_disable(struct clk_hw *hw)
+{
+	struct pegmatite_clkgate_group *group = to_pegmatite_clkgate_group(hw);
+	unsigned int i = group->num_gates;
+
+	clkgate_batching = true;
+	while (i--)
+		clk_disable(group->clks[i]);
+	clkgate_batching = false;
+
+	/*
+	 * One barrier posts the reset and enable writes of all the members
+	 */
+	wmb();
+
+	for (i = 0; i < group->num_gates; i++)
+		group->gates[i]->batched = false;
+}
+
+static const struct clk_ops pegmatite_clkgate_group_ops = {
+	.prepare = pegmatite_clkgate_group_prepare,
+	.unprepare = pegmatite_clkgate_group_unprepare,
+	.enable = pegmatite_clkgate_group_enable,
+	.disable = pegmatite_clkgate_group_disable,
+};
+
+static void __init of_pegmatite_clkgate_group_setup(struct device_node *node)
+{
+	struct pegmatite_clkgate_group *group;
+	struct clk *clk;
+	struct device_node *member_np;
+	struct clk_init_data *init;
+	int num_gates;
+	unsigned int i;
+
+	num_gates = of_count_phandle_with_args(node, "clocks", "#clock-cells");
+	if (num_gates <= 0) {
+		pr_err("%s: %s has no member gates\n", __func__, node->name);
+		return;
+	}
+
+	group = kzalloc(sizeof(*group), GFP_KERNEL);
+	if (!group) {
+		pr_err("%s: could not allocate clkgate group\n", __func__);
+		return;
+	}
+
+	init = kzalloc(sizeof(*init), GFP_KERNEL);
+	if (!init) {
+		pr_err("%s: could not allocate clkgate group init\n", __func__);
+		goto free_out;
+	}
+
+	group->clks = kcalloc(num_gates, sizeof(*group->clks), GFP_KERNEL);
+	group->gates = kcalloc(num_gates, sizeof(*group->gates), GFP_KERNEL);
+	if (!group->clks || !group->gates) {
+		pr_err("%s: could not allocate clkgate group members\n", __func__);
+		goto free_out2;
+	}
+
+	/*
+	 * Only pegmatite gates can be members, since the group reads their
+	 * status registers
+	 */
+	for (i = 0; i < num_gates; i++) {
+		member_np = of_parse_phandle(node, "clocks", i);
+		if (!of_device_is_compatible(member_np, "marvell,pegmatite-clkgate")) {
+			pr_err("%s: %s: member %u is not a pegmatite gate\n", __func__, node->name, i);
+			of_node_put(member_np);
+			goto put_out;
+		}
+		of_node_put(member_np);
+
+		clk = of_clk_get(node, i);
+		if (IS_ERR(clk)) {
+			pr_err("%s: %s: could not get member %u\n", __func__, node->name, i);
+			goto put_out;
+		}
+		group->clks[i] = clk;
+		group->num_gates++;
+		group->gates[i] = to_pegmatite_clkgate(__clk_get_hw(clk));
+	}
+
+	init->name = node->name;
+	init->ops = &pegmatite_clkgate_group_ops;
+	init->flags = CLK_IS_ROOT | CLK_IGNORE_UNUSED;
+	init->parent_names = NULL;
+	init->num_parents = 0;
+
+	group->hw.init = init;
+
+	clk = clk_register(NULL, &group->hw);
+	if(WARN_ON(IS_ERR(clk)))
+		goto put_out;
+
+	of_clk_add_provider(node, of_clk_src_simple_get, clk);
+
+	return;
+put_out:
+	for (i = 0; i < group->num_gates; i++)
+		clk_put(group->clks[i]);
+free_out2:
+	kfree(group->clks);
+	kfree(group->gates);
+	kfree(init);
+free_out:
+	kfree(group);
+}
+
+CLK_OF_DECLARE(pegmatite_clkgate_group, "marvell,pegmatite-clkgate-group", of_pegmatite_clkgate_group_setup);
@@ -13,6 +13,8 @@
 #include <linux/of.h>
 #include <linux/io.h>
 
+#include "clk-pegmatite.h"
+
 #define SRCSEL_MASK 0x3
 #define SRCSEL_SHIFT 24
 #define HIDIV_MASK 0xff
@@ -24,15 +26,26 @@
 #define PRE_DIV_VAL_SHIFT 27
 #define PRE_DIV_VAL_MASK 0xff
 
+#define CLKGEN_CONFIG 0x0
+#define CLKGEN_DIV 0x4
+/*
+ * CLKGEN_DIV isn't written by this driver and reflects the hardware's
+ * current divide, so it is cached read-only: never restored, and read back
+ * after every write to CLKGEN_CONFIG
+ */
+#define CLKGEN_NUM_REGS 2
+
 #define to_pegmatite_clkgen(_hw) container_of(_hw, struct pegmatite_clkgen, hw)
 struct pegmatite_clkgen {
 	struct clk_hw		hw;
 	void __iomem		*config;
+	struct pegmatite_regcache cache;
 	int			clock_source;
 	int			max_divide;
 	int			use_div_select;
 	bool			use_prediv;
 	int			prediv_shift;
+	struct pegmatite_clk_stats *stats;
 };
 
 static unsigned long pegmatite_clkgen_recalc_rate(struct clk_hw *hw, unsigned long parent_rate)
@@ -42,7 +55,7 @@ static unsigned long pegmatite_clkgen_recalc_rate(struct clk_hw *hw, unsigned lo
 	u32 val;
 
 	if (gen->use_div_select) {
-		val = readl(gen->config);
+		val = pegmatite_regcache_read(&gen->cache, CLKGEN_CONFIG);
 
 		if (val & (1 << DIV_SEL_SHIFT))
 			rate = parent_rate / 4;
@@ -55,7 +68,7 @@ static unsigned long pegmatite_clkgen_recalc_rate(struct clk_hw *hw, unsigned lo
 		 */
 		unsigned int hidiv, lodiv;
 
-		val = readl(gen->config + 4);
+		val = pegmatite_regcache_read(&gen->cache, CLKGEN_DIV);
 
 		if (gen->use_prediv) {
 			if (val & (1 << PRE_DIV_ENB_SHIFT))
@@ -79,7 +92,9 @@ static unsigned long pegmatite_clkgen_recalc_rate(struct clk_hw *hw, unsigned lo
 static int pegmatite_clkgen_set_rate(struct clk_hw *hw, unsigned long rate, unsigned long parent_rate)
 {
 	struct pegmatite_clkgen *gen = to_pegmatite_clkgen(hw);
-	u32 val = readl(gen->config);
+	u32 val = pegmatite_regcache_read(&gen->cache, CLKGEN_CONFIG);
+
+	pegmatite_clk_stats_start(gen->stats);
 
 	if (gen->use_div_select) {
 		u32 div_sel = 0;
@@ -106,7 +121,7 @@ static int pegmatite_clkgen_set_rate(struct clk_hw *hw, unsigned long rate, unsi
 			 */
 			if (gen->use_prediv) {
 				if ((parent_rate / gen->max_divide) > rate) {
-					prediv = readl(gen->config + 4);
+					prediv = pegmatite_regcache_read(&gen->cache, CLKGEN_DIV);
 					prediv >>= gen->prediv_shift;
 					prediv &= PRE_DIV_VAL_MASK;
 
@@ -146,12 +161,24 @@ static int pegmatite_clkgen_set_rate(struct clk_hw *hw, unsigned long rate, unsi
 		val |= (hidiv & HIDIV_MASK) << HIDIV_SHIFT;
 		val |= (lodiv & LODIV_MASK) << LODIV_SHIFT;
 	}
+	pegmatite_clk_stats_phase(gen->stats, PEGMATITE_CLK_SOLVE);
 
-	writel(val, gen->config);
+	pegmatite_regcache_write(&gen->cache, val, CLKGEN_CONFIG);
+	pegmatite_regcache_refresh(&gen->cache, CLKGEN_DIV);
+	pegmatite_clk_stats_phase(gen->stats, PEGMATITE_CLK_PROGRAM);
+	pegmatite_clk_stats_end(gen->stats, rate);
 
 	return 0;
 }
 
+static void pegmatite_clkgen_resume(struct clk_hw *hw)
+{
+	struct pegmatite_clkgen *gen = to_pegmatite_clkgen(hw);
+
+	pegmatite_regcache_restore(&gen->cache);
+	pegmatite_regcache_refresh(&gen->cache, CLKGEN_DIV);
+}
+
 static long pegmatite_clkgen_round_rate(struct clk_hw *hw, unsigned long rate, unsigned long *prate)
 {
 	struct pegmatite_clkgen *gen = to_pegmatite_clkgen(hw);
@@ -175,7 +202,7 @@ static long pegmatite_clkgen_round_rate(struct clk_hw *hw, unsigned long rate, u
 		 */
 		if (gen->use_prediv) {
 			if ((calc_rate / gen->max_divide) > rate) {
-				unsigned int prediv = readl(gen->config + 4);
+				unsigned int prediv = pegmatite_regcache_read(&gen->cache, CLKGEN_DIV);
 				prediv >>= gen->prediv_shift;
 				prediv &= PRE_DIV_VAL_MASK;
 
@@ -202,10 +229,76 @@ static long pegmatite_clkgen_round_rate(struct clk_hw *hw, unsigned long rate, u
 	return calc_rate;
 }
 
+static long pegmatite_clkgen_determine_rate(struct clk_hw *hw, unsigned long rate,
+					    unsigned long min_rate, unsigned long max_rate,
+					    unsigned long *best_parent_rate,
+					    struct clk_hw **best_parent_hw)
+{
+	struct pegmatite_clkgen *gen = to_pegmatite_clkgen(hw);
+	struct clk *parent = __clk_get_parent(hw->clk);
+	unsigned long cur_parent_rate = *best_parent_rate;
+	unsigned long best_parent = cur_parent_rate;
+	unsigned long parent_rate, calc_rate, best;
+	unsigned int div, min_div, max_div;
+
+	if (parent)
+		*best_parent_hw = __clk_get_hw(parent);
+
+	/*
+	 * Start with what the dividers can do from the current parent rate.
+	 * If that is exact, or we aren't allowed to change the parent, we
+	 * are done.
+	 */
+	best = pegmatite_clkgen_round_rate(hw, rate, best_parent_rate);
+	if (best == rate || rate == 0 || !parent ||
+	    !(__clk_get_flags(hw->clk) & CLK_SET_RATE_PARENT))
+		return best;
+
+	/*
+	 * Otherwise ask the parent (normally a pll) for rate * div for every
+	 * divide we can do, and keep whichever lands closest.  If several are
+	 * exact, prefer the parent rate nearest the current one so the other
+	 * children of the parent are disturbed as little as possible.
+	 * The predivider is a fixed setting so it is not part of the search.
+	 */
+	if (gen->use_div_select) {
+		min_div = 2;
+		max_div = 4;
+	} else {
+		min_div = 1;
+		max_div = gen->max_divide;
+	}
+
+	for (div = min_div; div <= max_div; div += (gen->use_div_select ? 2 : 1)) {
+		if (rate > ULONG_MAX / div)
+			break;
+
+		parent_rate = __clk_round_rate(parent, rate * div);
+		if (parent_rate == 0)
+			continue;
+
+		calc_rate = parent_rate / div;
+		if (calc_rate < min_rate || calc_rate > max_rate)
+			continue;
+
+		if (abs(rate - calc_rate) < abs(rate - best) ||
+		    (calc_rate == best &&
+		     abs(cur_parent_rate - parent_rate) < abs(cur_parent_rate - best_parent))) {
+			best = calc_rate;
+			best_parent = parent_rate;
+		}
+	}
+
+	*best_parent_rate = best_parent;
+
+	return best;
+}
+
 const struct clk_ops pegmatite_clkgen_ops = {
 	.recalc_rate = pegmatite_clkgen_recalc_rate,
 	.set_rate = pegmatite_clkgen_set_rate,
 	.round_rate = pegmatite_clkgen_round_rate,
+	.determine_rate = pegmatite_clkgen_determine_rate,
 };
 
 static void __init of_pegmatite_clkgen_setup(struct device_node *node)
@@ -273,6 +366,13 @@ static void __init of_pegmatite_clkgen_setup(struct device_node *node)
 	init->name = kasprintf(GFP_KERNEL, "%s", node->name);
 	init->ops = &pegmatite_clkgen_ops;
 	init->flags = 0;
+
+	/*
+	 * set-rate-parent lets a rate request retune the parent pll so the
+	 * dividers can hit the requested rate exactly
+	 */
+	if (of_property_read_bool(node, "set-rate-parent"))
+		init->flags |= CLK_SET_RATE_PARENT;
 	parent_clk = of_clk_get(node, gen->clock_source);
 	parent_name = __clk_get_name(parent_clk);
 	init->parent_names = &parent_name;
@@ -280,23 +380,29 @@ static void __init of_pegmatite_clkgen_setup(struct device_node *node)
 
 	gen->hw.init = init;
 	gen->config = clk_base;
-	val = readl(gen->config);
+	pegmatite_regcache_init(&gen->cache, clk_base, CLKGEN_NUM_REGS);
+	pegmatite_regcache_set_readonly(&gen->cache, CLKGEN_DIV);
+	pegmatite_regcache_fill(&gen->cache);
+	val = pegmatite_regcache_read(&gen->cache, CLKGEN_CONFIG);
 	val &= ~(SRCSEL_MASK << SRCSEL_SHIFT);
 	val |= (gen->clock_source & SRCSEL_MASK) << SRCSEL_SHIFT;
-	writel(val, gen->config);
+	pegmatite_regcache_write(&gen->cache, val, CLKGEN_CONFIG);
+	pegmatite_regcache_refresh(&gen->cache, CLKGEN_DIV);
 
 	clk = clk_register(NULL, &gen->hw);
 	if(WARN_ON(IS_ERR(clk)))
 		goto map_out;
 
 	of_clk_add_provider(node, of_clk_src_simple_get, clk);
+	gen->stats = pegmatite_clk_stats_register(&gen->hw);
+	pegmatite_clk_pm_register(&gen->hw, PEGMATITE_CLK_PM_DIV, NULL, pegmatite_clkgen_resume);
 
 	/*
-	 * If a default rate was specified in the device tree, set it here
+	 * If a default rate was specified in the device tree, hand it to the
+	 * clock plan, which sets it here unless a plan is in use
 	 * If this clock can be gated, setting the default rate does not ungate it
 	 */
-	if(default_rate > 0)
-		clk_set_rate(clk, default_rate);
+	pegmatite_clk_plan_add(&gen->hw, &pegmatite_clkgen_ops, default_rate);
 
 	return;
 map_out:
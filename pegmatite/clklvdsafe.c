@@ -13,6 +13,11 @@
 #include <linux/of.h>
 #include <linux/io.h>
 #include <linux/module.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include "clk-pegmatite.h"
+#include "clk-pegmatite-math.h"
 
 #define CLKOUT_MASK 0x1
 #define CLKOUT_SHIFT 31
@@ -26,16 +31,58 @@
 struct pegmatite_clklvdsafe {
 	struct clk_hw       hw;
 	void __iomem        *base;
+	struct pegmatite_regcache cache;
 	struct clk          *parent_clk;
+	/*
+	 * Divider set while the parent was gated.  set_rate runs under the
+	 * prepare mutex and enable under the enable spinlock, so lock covers
+	 * these and the register update that applies them.
+	 */
+	spinlock_t          lock;
+	u32                 pending_div;
+	bool                div_pending;
+	/* Tells the clk core about a divider enable read or applied */
+	struct work_struct  recalc_work;
+	struct pegmatite_clk_stats *stats;
 };
 
+#define DIV_MASK ((HIDIV_MASK << HIDIV_SHIFT) | (LODIV_MASK << LODIV_SHIFT))
+
+/*
+ * The register can only be read while the parent is running, so the cache
+ * is filled on the first access with the parent enabled.  Until then it
+ * holds the reset value, hidiv and lodiv 0 (a divide by 2), and the rate is
+ * worked out from that.  If the register turns out to hold another divider,
+ * the clk core is told about the new rate.
+ */
+static u32 pegmatite_clklvdsafe_readl(struct pegmatite_clklvdsafe *lvdsafe)
+{
+	u32 assumed;
+
+	if (!lvdsafe->cache.valid) {
+		assumed = pegmatite_regcache_read(&lvdsafe->cache, 0);
+		pegmatite_regcache_fill(&lvdsafe->cache);
+		if (!lvdsafe->div_pending && keventd_up() &&
+		    ((assumed ^ pegmatite_regcache_read(&lvdsafe->cache, 0)) & DIV_MASK))
+			schedule_work(&lvdsafe->recalc_work);
+	}
+
+	return pegmatite_regcache_read(&lvdsafe->cache, 0);
+}
+
+static void pegmatite_clklvdsafe_writel(struct pegmatite_clklvdsafe *lvdsafe, u32 val)
+{
+	pegmatite_regcache_write(&lvdsafe->cache, val, 0);
+	lvdsafe->cache.valid = true;
+}
+
 static int pegmatite_clklvdsafe_is_enabled(struct clk_hw *hw)
 {
 	struct pegmatite_clklvdsafe *lvdsafe = to_pegmatite_clklvdsafe(hw);
 	unsigned int val = 0;
 	if (__clk_is_enabled(lvdsafe->parent_clk))
 	{
-		val = readl(lvdsafe->base);
+		val = pegmatite_clklvdsafe_readl(lvdsafe);
 		val = (val >> CLKOUT_SHIFT) & CLKOUT_MASK;
 	}
 	return (val);
@@ -44,53 +91,89 @@ static int pegmatite_clklvdsafe_is_enabled(struct clk_hw *hw)
 static int pegmatite_clklvdsafe_enable(struct clk_hw *hw)
 {
 	struct pegmatite_clklvdsafe *lvdsafe = to_pegmatite_clklvdsafe(hw);
-	unsigned int val = readl(lvdsafe->base);
+	unsigned long flags;
+	unsigned int val;
+
+	spin_lock_irqsave(&lvdsafe->lock, flags);
+	val = pegmatite_clklvdsafe_readl(lvdsafe);
+
+	/*
+	 * The parent is running now, so apply a divider that was set while
+	 * it was gated
+	 */
+	if (lvdsafe->div_pending) {
+		val &= ~(HIDIV_MASK << HIDIV_SHIFT);
+		val &= ~(LODIV_MASK << LODIV_SHIFT);
+		val |= lvdsafe->pending_div;
+		lvdsafe->div_pending = false;
+		if (keventd_up())
+			schedule_work(&lvdsafe->recalc_work);
+	}
+
 	val |= (CLKOUT_MASK << CLKOUT_SHIFT);
-	writel(val, lvdsafe->base);
+	pegmatite_clklvdsafe_writel(lvdsafe, val);
+	spin_unlock_irqrestore(&lvdsafe->lock, flags);
 	return 0;
 }
 
+/*
+ * The rate is worked out from the cached (or pending) divider, so neither the
+ * register nor the parent's state is touched here
+ */
 static unsigned long pegmatite_clklvdsafe_recalc_rate(struct clk_hw *hw, unsigned long parent_rate)
 {
 	struct pegmatite_clklvdsafe *lvdsafe = to_pegmatite_clklvdsafe(hw);
 	unsigned long rate = parent_rate;
 	unsigned int hidiv, lodiv;
+	unsigned long flags;
 	u32 val = 0;
-	if (parent_rate == 0 || !__clk_is_enabled(lvdsafe->parent_clk)) {
-	return 0;
+	if (parent_rate == 0) {
+		return 0;
 	}
 
-	val = readl(lvdsafe->base);
+	spin_lock_irqsave(&lvdsafe->lock, flags);
+	if (lvdsafe->div_pending)
+		val = lvdsafe->pending_div;
+	else
+		val = pegmatite_regcache_read(&lvdsafe->cache, 0);
+	spin_unlock_irqrestore(&lvdsafe->lock, flags);
+
 	hidiv = (val >> HIDIV_SHIFT) & HIDIV_MASK;
 	lodiv = (val >> LODIV_SHIFT) & LODIV_MASK;
 	rate /= (hidiv + 1 + lodiv + 1);
 	return rate;
 }
 
+/*
+ * The core only recalculates a clock without CLK_GET_RATE_NOCACHE on a rate
+ * or parent change, so set the rate the divider now gives.  If the core
+ * already has that rate this does nothing; otherwise set_rate writes back
+ * the same divider, and the core recalculates this clock and its children
+ * and sends the rate change notifications.
+ */
+static void pegmatite_clklvdsafe_recalc_work(struct work_struct *work)
+{
+	struct pegmatite_clklvdsafe *lvdsafe = container_of(work,
+				struct pegmatite_clklvdsafe, recalc_work);
+	unsigned long rate;
+
+	rate = pegmatite_clklvdsafe_recalc_rate(&lvdsafe->hw,
+						clk_get_rate(lvdsafe->parent_clk));
+	if (rate)
+		clk_set_rate(lvdsafe->hw.clk, rate);
+}
+
 static int pegmatite_clklvdsafe_set_rate(struct clk_hw *hw, unsigned long rate, unsigned long parent_rate)
 {
 	struct pegmatite_clklvdsafe *lvdsafe = to_pegmatite_clklvdsafe(hw);
 	unsigned int totaldiv, hidiv, lodiv;
+	unsigned long flags;
 	u32 val;
-	if (parent_rate == 0 || rate == 0 || !__clk_is_enabled(lvdsafe->parent_clk)) {
-	return 0;
-	}
-	totaldiv = parent_rate / rate;
-	if (totaldiv < 1 + 1)
-		totaldiv = 1 + 1;
-	if (totaldiv > HIDIV_MASK + 1 + LODIV_MASK + 1)
-		totaldiv = HIDIV_MASK + 1 + LODIV_MASK + 1;
-	/* if we aren't going over, check if the next divider is closer */
-	if ((totaldiv < HIDIV_MASK + 1 + LODIV_MASK + 1) &&
-		(abs(rate - parent_rate / totaldiv) > abs(rate - parent_rate / (totaldiv + 1))))
-	{
-		totaldiv++;
+	if (parent_rate == 0 || rate == 0) {
+		return 0;
 	}
-	/* make sure we are in a valid range */
-	if (totaldiv < 1 + 1)
-		totaldiv = 1 + 1;
-	if (totaldiv > HIDIV_MASK + 1 + LODIV_MASK + 1)
-		totaldiv = HIDIV_MASK + 1 + LODIV_MASK + 1;
+	pegmatite_clk_stats_start(lvdsafe->stats);
+	totaldiv = pegmatite_clklvdsafe_calc_div(rate, parent_rate);
 	/* split total divider into low/high */
 	lodiv = totaldiv / 2;
 	hidiv = totaldiv - lodiv;
@@ -99,50 +182,138 @@ static int pegmatite_clklvdsafe_set_rate(struct clk_hw *hw, unsigned long rate,
 	hidiv--;
 	lodiv--;
 
-	val = readl(lvdsafe->base);
-	val &= ~(HIDIV_MASK << HIDIV_SHIFT);
-	val &= ~(LODIV_MASK << LODIV_SHIFT);
-	val |= (hidiv & HIDIV_MASK) << HIDIV_SHIFT;
+	val = (hidiv & HIDIV_MASK) << HIDIV_SHIFT;
 	val |= (lodiv & LODIV_MASK) << LODIV_SHIFT;
-	writel(val, lvdsafe->base);
+	pegmatite_clk_stats_phase(lvdsafe->stats, PEGMATITE_CLK_SOLVE);
+
+	/*
+	 * The register can't be written while the parent is gated, so keep the
+	 * divider until the next enable
+	 */
+	spin_lock_irqsave(&lvdsafe->lock, flags);
+	if (!__clk_is_enabled(lvdsafe->parent_clk)) {
+		lvdsafe->pending_div = val;
+		lvdsafe->div_pending = true;
+		spin_unlock_irqrestore(&lvdsafe->lock, flags);
+		pegmatite_clk_stats_end(lvdsafe->stats, rate);
+		return 0;
+	}
+
+	lvdsafe->div_pending = false;
+	val |= pegmatite_clklvdsafe_readl(lvdsafe) & ~DIV_MASK;
+	pegmatite_clklvdsafe_writel(lvdsafe, val);
+	spin_unlock_irqrestore(&lvdsafe->lock, flags);
+	pegmatite_clk_stats_phase(lvdsafe->stats, PEGMATITE_CLK_PROGRAM);
+	pegmatite_clk_stats_end(lvdsafe->stats, rate);
 
 	return 0;
 }
 
 static long pegmatite_clklvdsafe_round_rate(struct clk_hw *hw, unsigned long rate, unsigned long *parent_rate)
 {
-	struct pegmatite_clklvdsafe *lvdsafe = to_pegmatite_clklvdsafe(hw);
 	unsigned int totaldiv;
 
-	if (rate == 0 || *parent_rate == 0 || !__clk_is_enabled(lvdsafe->parent_clk)) {
+	if (rate == 0 || *parent_rate == 0) {
 		return 0;
 	}
-	totaldiv = *parent_rate / rate;
-	/* if we aren't going over, check if the next divider is closer */
-	if ((totaldiv < HIDIV_MASK + 1 + LODIV_MASK + 1) &&
-		(abs(rate - *parent_rate / totaldiv) > abs(rate - *parent_rate / (totaldiv + 1))))
-	{
-		totaldiv++;
-	}
-	/* make sure we are in a valid range */
-	if (totaldiv < 1 + 1)
-		totaldiv = 1 + 1;
-	if (totaldiv > HIDIV_MASK + 1 + LODIV_MASK + 1)
-		totaldiv = HIDIV_MASK + 1 + LODIV_MASK + 1;
+	totaldiv = pegmatite_clklvdsafe_calc_div(rate, *parent_rate);
 
 	return *parent_rate / totaldiv;
 }
 
+static long pegmatite_clklvdsafe_determine_rate(struct clk_hw *hw, unsigned long rate,
+						unsigned long min_rate, unsigned long max_rate,
+						unsigned long *best_parent_rate,
+						struct clk_hw **best_parent_hw)
+{
+	struct pegmatite_clklvdsafe *lvdsafe = to_pegmatite_clklvdsafe(hw);
+	unsigned long cur_parent_rate = *best_parent_rate;
+	unsigned long best_parent = cur_parent_rate;
+	unsigned long parent_rate, calc_rate, best;
+	unsigned int totaldiv;
+
+	*best_parent_hw = __clk_get_hw(lvdsafe->parent_clk);
+
+	/*
+	 * Start with what the dividers can do from the current parent rate.
+	 * If that is exact, or we aren't allowed to change the parent, we
+	 * are done.
+	 */
+	best = pegmatite_clklvdsafe_round_rate(hw, rate, best_parent_rate);
+	if (best == rate || best == 0 ||
+	    !(__clk_get_flags(hw->clk) & CLK_SET_RATE_PARENT))
+		return best;
+
+	/*
+	 * Ask the lvds pll for rate * totaldiv for every divide we can do and
+	 * keep whichever lands closest, preferring the parent rate nearest
+	 * the current one between equally good results.
+	 */
+	for (totaldiv = 1 + 1; totaldiv <= HIDIV_MASK + 1 + LODIV_MASK + 1; totaldiv++) {
+		if (rate > ULONG_MAX / totaldiv)
+			break;
+
+		parent_rate = __clk_round_rate(lvdsafe->parent_clk, rate * totaldiv);
+		if (parent_rate == 0)
+			continue;
+
+		calc_rate = parent_rate / totaldiv;
+		if (calc_rate < min_rate || calc_rate > max_rate)
+			continue;
+
+		if (abs(rate - calc_rate) < abs(rate - best) ||
+		    (calc_rate == best &&
+		     abs(cur_parent_rate - parent_rate) < abs(cur_parent_rate - best_parent))) {
+			best = calc_rate;
+			best_parent = parent_rate;
+		}
+	}
+
+	*best_parent_rate = best_parent;
+
+	return best;
+}
+
 static void pegmatite_clkgate_disable(struct clk_hw *hw)
 {
 	struct pegmatite_clklvdsafe *lvdsafe = to_pegmatite_clklvdsafe(hw);
+	unsigned long flags;
 	unsigned int val = 0;
 	if (!__clk_is_enabled(lvdsafe->parent_clk)) {
 		return;
 	}
-	val = readl(lvdsafe->base);
+	spin_lock_irqsave(&lvdsafe->lock, flags);
+	val = pegmatite_clklvdsafe_readl(lvdsafe);
 	val &= ~(CLKOUT_MASK << CLKOUT_SHIFT);
-	writel(val, lvdsafe->base);
+	pegmatite_clklvdsafe_writel(lvdsafe, val);
+	spin_unlock_irqrestore(&lvdsafe->lock, flags);
+}
+
+/*
+ * The register can only be written with the parent running, otherwise the
+ * divider is left pending for the next enable like in set_rate
+ */
+static void pegmatite_clklvdsafe_resume(struct clk_hw *hw)
+{
+	struct pegmatite_clklvdsafe *lvdsafe = to_pegmatite_clklvdsafe(hw);
+	unsigned long flags;
+	u32 val;
+
+	if (!lvdsafe->cache.valid)
+		return;
+
+	if (__clk_is_enabled(lvdsafe->parent_clk)) {
+		pegmatite_regcache_restore(&lvdsafe->cache);
+		return;
+	}
+
+	spin_lock_irqsave(&lvdsafe->lock, flags);
+	if (!lvdsafe->div_pending) {
+		val = pegmatite_regcache_read(&lvdsafe->cache, 0);
+		lvdsafe->pending_div = val & DIV_MASK;
+		lvdsafe->div_pending = true;
+	}
+	spin_unlock_irqrestore(&lvdsafe->lock, flags);
 }
 
 const struct clk_ops pegmatite_clklvdsafe_ops = {
@@ -151,6 +322,7 @@ const struct clk_ops pegmatite_clklvdsafe_ops = {
 	.is_enabled = pegmatite_clklvdsafe_is_enabled,
 	.recalc_rate = pegmatite_clklvdsafe_recalc_rate,
 	.round_rate = pegmatite_clklvdsafe_round_rate,
+	.determine_rate = pegmatite_clklvdsafe_determine_rate,
 	.set_rate = pegmatite_clklvdsafe_set_rate,
 };
 
@@ -179,21 +351,43 @@ static void __init of_pegmatite_clklvdsafe_setup(struct device_node *node)
 
 	init->name = kasprintf(GFP_KERNEL, "%s", node->name);
 	init->ops = &pegmatite_clklvdsafe_ops;
-
-	/* we want this to always check if the parent is gated. */
-	init->flags = CLK_GET_RATE_NOCACHE;
 	lvdsafe->parent_clk = of_clk_get(node, 0);
+
+	/*
+	 * The rate comes from the cached divider, so the clk core can cache it
+	 * too; set_rate while the parent is gated is deferred to enable.  With
+	 * the parent gated now, the cache starts out at the reset value and
+	 * the first enable corrects it (see pegmatite_clklvdsafe_readl).
+	 */
+	pegmatite_regcache_init(&lvdsafe->cache, lvdsafe->base, 1);
+	if (__clk_is_enabled(lvdsafe->parent_clk))
+		pegmatite_regcache_fill(&lvdsafe->cache);
+	init->flags = 0;
+
+	/*
+	 * set-rate-parent lets a rate request retune the lvds pll so the
+	 * dividers can hit the requested rate exactly
+	 */
+	if (of_property_read_bool(node, "set-rate-parent"))
+		init->flags |= CLK_SET_RATE_PARENT;
 	parent_name = __clk_get_name(lvdsafe->parent_clk);
 	init->parent_names = &parent_name;
 	init->num_parents = 1;
 
 	lvdsafe->hw.init = init;
+	spin_lock_init(&lvdsafe->lock);
+	INIT_WORK(&lvdsafe->recalc_work, pegmatite_clklvdsafe_recalc_work);
 
 	clk = clk_register(NULL, &lvdsafe->hw);
 	if(WARN_ON(IS_ERR(clk)))
 		goto map_out;
 
 	of_clk_add_provider(node, of_clk_src_simple_get, clk);
+	lvdsafe->stats = pegmatite_clk_stats_register(&lvdsafe->hw);
+	pegmatite_clk_pm_register(&lvdsafe->hw, PEGMATITE_CLK_PM_DIV, NULL, pegmatite_clklvdsafe_resume);
+
+	/* No default rate, but a clock plan must not move it unnoticed */
+	pegmatite_clk_plan_add(&lvdsafe->hw, &pegmatite_clklvdsafe_ops, 0);
 
 	return;
 map_out:
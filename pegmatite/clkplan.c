@@ -0,0 +1,390 @@
+/*
+ * Marvell Pegmatite SoC clock handling.
+ *
+ * Pegmatite boot-time clock plan
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2.  This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+#include <linux/kernel.h>
+#include <linux/clk.h>
+#include <linux/clk-provider.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/of.h>
+#include <linux/math64.h>
+
+#include "clk-pegmatite.h"
+
+/*
+ * Applying the clock-frequency of every node one at a time picks each pll
+ * rate without looking at what hangs off it, so leaf dividers often can't
+ * reach their targets exactly.  When the device tree has a
+ * marvell,pegmatite-clkplan node, the default rates are collected here
+ * instead and, once every clock listed in that node has registered, each
+ * pll gets the rate that minimises the total error of its leaves.  The plls
+ * are then programmed once and the leaves are set in a single pass.
+ *
+ * The plan node's clocks property lists the leaves to plan.  That also makes
+ * of_clk_init() run the plan after all of them are registered.
+ *
+ * clkgen registers only the clock-source selected in the device tree as its
+ * parent, so source selection is not part of the plan, and the set of plls
+ * in use is fixed by the device tree.  What the plan minimises instead is
+ * the number of plls it retunes: a pll keeps its current rate unless moving
+ * gains more than PLAN_KEEP_PPM per leaf, so it isn't relocked for nothing.
+ *
+ * Clocks without a clock-frequency are in the plan too, pinned at the rate
+ * they had before it ran.  They add to the cost of their pll like any leaf,
+ * so a pll rate that would move them is avoided, and any that still move
+ * are reported.
+ */
+
+/*
+ * Pll rates considered are leaf targets times 1..PLAN_MAX_MULT, within the
+ * range below
+ */
+#define PLAN_MAX_MULT		16
+#define PLAN_PLL_MIN_RATE	100000000UL
+#define PLAN_PLL_MAX_RATE	3000000000UL
+
+/*
+ * Total error per leaf a retune has to save to be worth relocking the pll
+ */
+#define PLAN_KEEP_PPM		100
+
+struct pegmatite_clk_plan_pll {
+	struct list_head	node;
+	struct clk_hw		*hw;
+	unsigned long		rate;		/* clock-frequency, or 0 */
+	unsigned long		cur_rate;
+	unsigned long		best_rate;
+	unsigned int		num_leaves;
+	unsigned int		num_pinned;
+};
+
+struct pegmatite_clk_plan_leaf {
+	struct list_head	node;
+	struct clk_hw		*hw;
+	const struct clk_ops	*ops;
+	unsigned long		rate;		/* clock-frequency, or current rate */
+	bool			pinned;		/* no clock-frequency */
+	unsigned long		planned_rate;
+	struct pegmatite_clk_plan_pll *pll;
+	/*
+	 * Rate of the leaf's direct parent relative to the pll (e.g. an sscg
+	 * in between), as parent_rate / pll_rate
+	 */
+	unsigned long		parent_rate;
+	unsigned long		pll_rate;
+};
+
+static __initdata LIST_HEAD(plan_plls);
+static __initdata LIST_HEAD(plan_leaves);
+
+/*
+ * -1 until we have looked for a plan node, then 0 or 1
+ */
+static int plan_enabled __initdata = -1;
+static bool plan_done __initdata;
+
+static bool __init pegmatite_clk_plan_enabled(void)
+{
+	struct device_node *np;
+
+	if (plan_enabled < 0) {
+		np = of_find_compatible_node(NULL, NULL, "marvell,pegmatite-clkplan");
+		plan_enabled = np && of_device_is_available(np);
+		of_node_put(np);
+	}
+
+	return plan_enabled && !plan_done;
+}
+
+void __init pegmatite_clk_plan_add_pll(struct clk_hw *hw, unsigned long rate)
+{
+	struct pegmatite_clk_plan_pll *pll;
+
+	if (!pegmatite_clk_plan_enabled()) {
+		if (rate > 0)
+			clk_set_rate(hw->clk, rate);
+		return;
+	}
+
+	pll = kzalloc(sizeof(*pll), GFP_KERNEL);
+	if (!pll) {
+		pr_err("%s: could not allocate plan entry\n", __func__);
+		if (rate > 0)
+			clk_set_rate(hw->clk, rate);
+		return;
+	}
+
+	pll->hw = hw;
+	pll->rate = rate;
+	list_add_tail(&pll->node, &plan_plls);
+}
+
+/*
+ * A rate of 0 (no clock-frequency) pins the clock at whatever rate it has
+ * when the plan runs
+ */
+void __init pegmatite_clk_plan_add(struct clk_hw *hw, const struct clk_ops *ops,
+				   unsigned long rate)
+{
+	struct pegmatite_clk_plan_leaf *leaf;
+
+	if (!pegmatite_clk_plan_enabled()) {
+		if (rate > 0)
+			clk_set_rate(hw->clk, rate);
+		return;
+	}
+
+	leaf = kzalloc(sizeof(*leaf), GFP_KERNEL);
+	if (!leaf) {
+		pr_err("%s: could not allocate plan entry\n", __func__);
+		if (rate > 0)
+			clk_set_rate(hw->clk, rate);
+		return;
+	}
+
+	leaf->hw = hw;
+	leaf->ops = ops;
+	leaf->rate = rate;
+	leaf->pinned = rate == 0;
+	list_add_tail(&leaf->node, &plan_leaves);
+}
+
+/*
+ * Find the pll (if any) that a leaf hangs off
+ */
+static struct pegmatite_clk_plan_pll * __init pegmatite_clk_plan_find_pll(struct clk *clk)
+{
+	struct pegmatite_clk_plan_pll *pll;
+
+	for (clk = __clk_get_parent(clk); clk; clk = __clk_get_parent(clk)) {
+		list_for_each_entry(pll, &plan_plls, node) {
+			if (pll->hw == __clk_get_hw(clk))
+				return pll;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * What the leaf would run at if its pll ran at pll_rate
+ */
+static unsigned long __init pegmatite_clk_plan_leaf_rate(struct pegmatite_clk_plan_leaf *leaf,
+						  unsigned long pll_rate)
+{
+	unsigned long parent_rate = pll_rate;
+
+	if (leaf->pll_rate && leaf->parent_rate != leaf->pll_rate)
+		parent_rate = (unsigned long)div64_u64((u64)pll_rate * leaf->parent_rate,
+						       leaf->pll_rate);
+
+	return leaf->ops->round_rate(leaf->hw, leaf->rate, &parent_rate);
+}
+
+/*
+ * Total error in ppm of all leaves of a pll if it ran at pll_rate
+ */
+static u64 __init pegmatite_clk_plan_cost(struct pegmatite_clk_plan_pll *pll,
+				   unsigned long pll_rate)
+{
+	struct pegmatite_clk_plan_leaf *leaf;
+	unsigned long rate;
+	u64 cost = 0;
+
+	list_for_each_entry(leaf, &plan_leaves, node) {
+		if (leaf->pll != pll)
+			continue;
+
+		rate = pegmatite_clk_plan_leaf_rate(leaf, pll_rate);
+		cost += div64_u64((u64)abs(leaf->rate - rate) * 1000000, leaf->rate);
+	}
+
+	return cost;
+}
+
+static void __init pegmatite_clk_plan_try(struct pegmatite_clk_plan_pll *pll,
+				   unsigned long cand, u64 *best_cost)
+{
+	unsigned long rate;
+	u64 cost;
+
+	if (cand < PLAN_PLL_MIN_RATE || cand > PLAN_PLL_MAX_RATE)
+		return;
+
+	/*
+	 * Score what the pll can actually produce, not the ideal rate
+	 */
+	rate = clk_round_rate(pll->hw->clk, cand);
+	if ((long)rate <= 0)
+		return;
+
+	cost = pegmatite_clk_plan_cost(pll, rate);
+	if (cost < *best_cost) {
+		*best_cost = cost;
+		pll->best_rate = rate;
+	}
+}
+
+static void __init pegmatite_clk_plan_solve(struct pegmatite_clk_plan_pll *pll)
+{
+	struct pegmatite_clk_plan_leaf *leaf;
+	unsigned int mult;
+	u64 best_cost = U64_MAX;
+	u64 cur_cost = U64_MAX;
+	u64 cand;
+
+	/*
+	 * Candidates are tried in order of preference, and only a strictly
+	 * better one replaces the current best: the device tree rate first,
+	 * then the current rate, then multiples of every leaf target.
+	 */
+	pll->best_rate = pll->rate ? pll->rate : pll->cur_rate;
+	if (pll->rate)
+		pegmatite_clk_plan_try(pll, pll->rate, &best_cost);
+	if (pll->cur_rate) {
+		pegmatite_clk_plan_try(pll, pll->cur_rate, &best_cost);
+		cur_cost = pegmatite_clk_plan_cost(pll, pll->cur_rate);
+	}
+
+	list_for_each_entry(leaf, &plan_leaves, node) {
+		if (leaf->pll != pll || leaf->pinned)
+			continue;
+
+		for (mult = 1; mult <= PLAN_MAX_MULT && best_cost; mult++) {
+			cand = (u64)leaf->rate * mult;
+			if (leaf->pll_rate && leaf->parent_rate != leaf->pll_rate)
+				cand = div64_u64(cand * leaf->pll_rate, leaf->parent_rate);
+			if (cand > PLAN_PLL_MAX_RATE)
+				break;
+			pegmatite_clk_plan_try(pll, (unsigned long)cand, &best_cost);
+		}
+	}
+
+	/*
+	 * Without a device tree rate to honour, only retune for a real gain
+	 */
+	if (!pll->rate && pll->cur_rate &&
+	    cur_cost <= best_cost + (u64)PLAN_KEEP_PPM * pll->num_leaves)
+		pll->best_rate = pll->cur_rate;
+}
+
+static void __init of_pegmatite_clkplan_setup(struct device_node *node)
+{
+	struct pegmatite_clk_plan_pll *pll, *tmp_pll;
+	struct pegmatite_clk_plan_leaf *leaf, *tmp_leaf;
+	struct clk *parent;
+	unsigned int num_plls = 0, num_retuned = 0;
+	unsigned long rate;
+
+	/*
+	 * Anything registering from now on sets its rate directly
+	 */
+	plan_done = true;
+
+	list_for_each_entry(pll, &plan_plls, node)
+		pll->cur_rate = clk_get_rate(pll->hw->clk);
+
+	/*
+	 * Group the leaves by pll and note how their direct parent relates
+	 * to it
+	 */
+	list_for_each_entry(leaf, &plan_leaves, node) {
+		if (leaf->pinned)
+			leaf->rate = clk_get_rate(leaf->hw->clk);
+
+		leaf->pll = pegmatite_clk_plan_find_pll(leaf->hw->clk);
+		if (!leaf->pll || !leaf->rate) {
+			leaf->pll = NULL;
+			continue;
+		}
+
+		leaf->pll->num_leaves++;
+		if (leaf->pinned)
+			leaf->pll->num_pinned++;
+		parent = __clk_get_parent(leaf->hw->clk);
+		leaf->parent_rate = parent ? clk_get_rate(parent) : 0;
+		leaf->pll_rate = leaf->pll->cur_rate;
+		if (!leaf->parent_rate || !leaf->pll_rate)
+			leaf->parent_rate = leaf->pll_rate = 0;
+	}
+
+	/*
+	 * Choose every pll rate, then program each pll once.  The plls are
+	 * all kicked first and their locks waited for together.
+	 */
+	pegmatite_pll_defer_lock(true);
+	list_for_each_entry(pll, &plan_plls, node) {
+		if (pll->num_leaves)
+			pegmatite_clk_plan_solve(pll);
+		else
+			pll->best_rate = pll->rate;
+
+		if (pll->best_rate && pll->best_rate != pll->cur_rate) {
+			clk_set_rate(pll->hw->clk, pll->best_rate);
+			num_retuned++;
+		}
+
+		if (pll->num_leaves)
+			num_plls++;
+
+		if (pll->best_rate)
+			pr_info("clkplan: %s %lu Hz (%u leaves, %u pinned)%s\n",
+				__clk_get_name(pll->hw->clk), pll->best_rate,
+				pll->num_leaves, pll->num_pinned,
+				pll->best_rate == pll->cur_rate ? ", kept" : "");
+	}
+	pegmatite_pll_defer_lock(false);
+	pegmatite_pll_wait_pending();
+
+	/*
+	 * Set the leaves to the rates their dividers can reach exactly from
+	 * the planned pll rate, so none of them asks to retune its pll again
+	 */
+	list_for_each_entry(leaf, &plan_leaves, node) {
+		/*
+		 * Pinned clocks are left alone; report any that moved anyway
+		 */
+		if (leaf->pinned) {
+			rate = clk_get_rate(leaf->hw->clk);
+			if (leaf->rate && rate != leaf->rate)
+				pr_warn("clkplan:   %s not planned, moved from %lu Hz to %lu Hz\n",
+					__clk_get_name(leaf->hw->clk), leaf->rate, rate);
+			continue;
+		}
+
+		if (leaf->pll) {
+			leaf->planned_rate = pegmatite_clk_plan_leaf_rate(leaf,
+						clk_get_rate(leaf->pll->hw->clk));
+			if ((long)leaf->planned_rate <= 0)
+				leaf->planned_rate = leaf->rate;
+		} else {
+			leaf->planned_rate = leaf->rate;
+		}
+
+		clk_set_rate(leaf->hw->clk, leaf->planned_rate);
+
+		pr_info("clkplan:   %s target %lu Hz, got %lu Hz\n",
+			__clk_get_name(leaf->hw->clk), leaf->rate,
+			clk_get_rate(leaf->hw->clk));
+	}
+
+	pr_info("clkplan: %u plls in use, %u retuned\n", num_plls, num_retuned);
+
+	list_for_each_entry_safe(leaf, tmp_leaf, &plan_leaves, node) {
+		list_del(&leaf->node);
+		kfree(leaf);
+	}
+
+	list_for_each_entry_safe(pll, tmp_pll, &plan_plls, node) {
+		list_del(&pll->node);
+		kfree(pll);
+	}
+}
+
+CLK_OF_DECLARE(pegmatite_clkplan, "marvell,pegmatite-clkplan", of_pegmatite_clkplan_setup);
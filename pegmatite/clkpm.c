@@ -0,0 +1,110 @@
+/*
+ * Marvell Pegmatite SoC clock handling.
+ *
+ * Pegmatite clock register save and restore across suspend
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2.  This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+#include <linux/kernel.h>
+#include <linux/clk-provider.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/syscore_ops.h>
+#include <linux/init.h>
+
+#include "clk-pegmatite.h"
+
+/*
+ * The clock registers lose their contents in the deep low-power states.
+ * Instead of taking every clock through set_rate again at resume, each
+ * driver writes back its register image: the shadow caches for plls and
+ * dividers, the table kept by the sscg and the gate state saved at suspend.
+ *
+ * Clocks are restored a stage at a time, in the order of the stages.  All
+ * plls are programmed first and their locks are waited for together before
+ * anything downstream is touched.
+ */
+
+struct pegmatite_clk_pm {
+	struct list_head	node;
+	struct clk_hw		*hw;
+	void			(*suspend)(struct clk_hw *hw);
+	void			(*resume)(struct clk_hw *hw);
+};
+
+static struct list_head clk_pm_stages[PEGMATITE_CLK_PM_NR_STAGES] = {
+	[PEGMATITE_CLK_PM_PLL]	= LIST_HEAD_INIT(clk_pm_stages[PEGMATITE_CLK_PM_PLL]),
+	[PEGMATITE_CLK_PM_SSCG]	= LIST_HEAD_INIT(clk_pm_stages[PEGMATITE_CLK_PM_SSCG]),
+	[PEGMATITE_CLK_PM_DIV]	= LIST_HEAD_INIT(clk_pm_stages[PEGMATITE_CLK_PM_DIV]),
+	[PEGMATITE_CLK_PM_GATE]	= LIST_HEAD_INIT(clk_pm_stages[PEGMATITE_CLK_PM_GATE]),
+};
+
+void pegmatite_clk_pm_register(struct clk_hw *hw, enum pegmatite_clk_pm_stage stage,
+			       void (*suspend)(struct clk_hw *hw),
+			       void (*resume)(struct clk_hw *hw))
+{
+	struct pegmatite_clk_pm *pm;
+
+	pm = kzalloc(sizeof(*pm), GFP_KERNEL);
+	if (!pm) {
+		pr_err("%s: could not allocate clk pm entry\n", __func__);
+		return;
+	}
+
+	pm->hw = hw;
+	pm->suspend = suspend;
+	pm->resume = resume;
+	list_add_tail(&pm->node, &clk_pm_stages[stage]);
+}
+
+/*
+ * Downstream clocks are saved first
+ */
+static int pegmatite_clk_pm_suspend(void)
+{
+	struct pegmatite_clk_pm *pm;
+	int stage;
+
+	for (stage = PEGMATITE_CLK_PM_NR_STAGES - 1; stage >= 0; stage--) {
+		list_for_each_entry_reverse(pm, &clk_pm_stages[stage], node) {
+			if (pm->suspend)
+				pm->suspend(pm->hw);
+		}
+	}
+
+	return 0;
+}
+
+static void pegmatite_clk_pm_resume(void)
+{
+	struct pegmatite_clk_pm *pm;
+	int stage;
+
+	for (stage = 0; stage < PEGMATITE_CLK_PM_NR_STAGES; stage++) {
+		list_for_each_entry(pm, &clk_pm_stages[stage], node) {
+			if (pm->resume)
+				pm->resume(pm->hw);
+		}
+		wmb();
+
+		/*
+		 * The pll resume only kicks the plls
+		 */
+		if (stage == PEGMATITE_CLK_PM_PLL)
+			__pegmatite_pll_wait_pending();
+	}
+}
+
+static struct syscore_ops pegmatite_clk_syscore_ops = {
+	.suspend	= pegmatite_clk_pm_suspend,
+	.resume		= pegmatite_clk_pm_resume,
+};
+
+static int __init pegmatite_clk_pm_init(void)
+{
+	register_syscore_ops(&pegmatite_clk_syscore_ops);
+	return 0;
+}
+device_initcall(pegmatite_clk_pm_init);
@@ -0,0 +1,338 @@
+/*
+ * Marvell Pegmatite SoC clock handling.
+ *
+ * Pegmatite clock rate change statistics
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2.  This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+#include <linux/kernel.h>
+#include <linux/clk.h>
+#include <linux/clk-provider.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/init.h>
+
+#include "clk-pegmatite.h"
+
+#define CREATE_TRACE_POINTS
+#include "clk-pegmatite-trace.h"
+
+/*
+ * Every set_rate of a pll, clkgen, clkfd or clklvdsafe is timed per phase
+ * and added to log2 histograms, shown in debugfs under pegmatite-clk/ with
+ * one file per clock.  Writing anything to a file clears it.
+ *
+ * A rate change usually touches more than one clock (a leaf asking its pll
+ * to move retunes everything under the pll), so each clock also has a
+ * notifier, and the time from the first pre-change to the last post-change
+ * notification is recorded against the topmost clock that changed.
+ */
+
+/*
+ * Bucket b counts times in [2^(b-1), 2^b) ns, the last one everything above
+ */
+#define STATS_HIST_BUCKETS	32
+
+struct pegmatite_clk_hist {
+	u32		buckets[STATS_HIST_BUCKETS];
+	u64		count;
+	u64		total_ns;
+	u64		max_ns;
+};
+
+enum {
+	STATS_SET_RATE = PEGMATITE_CLK_NR_PHASES,
+	STATS_TRANSITION,
+	STATS_NR_HISTS,
+};
+
+static const char * const stats_hist_names[STATS_NR_HISTS] = {
+	[PEGMATITE_CLK_SOLVE]	= "solve",
+	[PEGMATITE_CLK_BYPASS]	= "bypass",
+	[PEGMATITE_CLK_PROGRAM]	= "program",
+	[PEGMATITE_CLK_LOCK]	= "lock",
+	[STATS_SET_RATE]	= "set_rate",
+	[STATS_TRANSITION]	= "subtree",
+};
+
+struct pegmatite_clk_stats {
+	struct list_head	node;
+	struct clk_hw		*hw;
+	struct notifier_block	nb;
+	ktime_t			start;
+	ktime_t			mark;
+	u64			phase_ns[PEGMATITE_CLK_NR_PHASES];
+	struct pegmatite_clk_hist hist[STATS_NR_HISTS];
+};
+
+#define to_pegmatite_clk_stats(_nb) container_of(_nb, struct pegmatite_clk_stats, nb)
+
+static LIST_HEAD(stats_list);
+static DEFINE_MUTEX(stats_mutex);
+static struct dentry *stats_dir;
+
+/*
+ * The transition in progress.  Rate change notifiers run under the clock
+ * framework's prepare lock, so there is only ever one.
+ */
+static struct {
+	struct pegmatite_clk_stats *top;
+	unsigned long		old_rate;
+	unsigned long		new_rate;
+	ktime_t			start;
+	ktime_t			last_post;
+	unsigned int		pending;
+	unsigned int		num_clks;
+	bool			posting;
+} transition;
+
+static void pegmatite_clk_hist_add(struct pegmatite_clk_hist *hist, u64 ns)
+{
+	hist->buckets[min_t(unsigned int, fls64(ns), STATS_HIST_BUCKETS - 1)]++;
+	hist->count++;
+	hist->total_ns += ns;
+	if (ns > hist->max_ns)
+		hist->max_ns = ns;
+}
+
+void pegmatite_clk_stats_start(struct pegmatite_clk_stats *stats)
+{
+	if (!stats)
+		return;
+
+	memset(stats->phase_ns, 0, sizeof(stats->phase_ns));
+	stats->start = ktime_get();
+	stats->mark = stats->start;
+}
+
+/*
+ * Charge the time since the last mark to a phase
+ */
+void pegmatite_clk_stats_phase(struct pegmatite_clk_stats *stats,
+			       enum pegmatite_clk_phase phase)
+{
+	ktime_t now;
+
+	if (!stats)
+		return;
+
+	now = ktime_get();
+	stats->phase_ns[phase] += ktime_to_ns(ktime_sub(now, stats->mark));
+	stats->mark = now;
+}
+
+void pegmatite_clk_stats_end(struct pegmatite_clk_stats *stats, unsigned long rate)
+{
+	unsigned int i;
+
+	if (!stats)
+		return;
+
+	/*
+	 * Phases a clock doesn't have are left out of their histograms
+	 */
+	for (i = 0; i < PEGMATITE_CLK_NR_PHASES; i++) {
+		if (stats->phase_ns[i])
+			pegmatite_clk_hist_add(&stats->hist[i], stats->phase_ns[i]);
+	}
+	pegmatite_clk_hist_add(&stats->hist[STATS_SET_RATE],
+			       ktime_to_ns(ktime_sub(stats->mark, stats->start)));
+
+	trace_pegmatite_clk_set_rate(__clk_get_name(stats->hw->clk), rate,
+				     stats->phase_ns[PEGMATITE_CLK_SOLVE],
+				     stats->phase_ns[PEGMATITE_CLK_BYPASS],
+				     stats->phase_ns[PEGMATITE_CLK_PROGRAM],
+				     stats->phase_ns[PEGMATITE_CLK_LOCK]);
+}
+
+static void pegmatite_clk_transition_end(ktime_t end)
+{
+	u64 ns = ktime_to_ns(ktime_sub(end, transition.start));
+
+	if (transition.top) {
+		pegmatite_clk_hist_add(&transition.top->hist[STATS_TRANSITION], ns);
+		trace_pegmatite_clk_transition(__clk_get_name(transition.top->hw->clk),
+					       transition.old_rate, transition.new_rate,
+					       ns, transition.num_clks);
+	}
+
+	transition.top = NULL;
+	transition.pending = 0;
+	transition.posting = false;
+}
+
+static int pegmatite_clk_stats_notify(struct notifier_block *nb,
+				      unsigned long event, void *data)
+{
+	struct pegmatite_clk_stats *stats = to_pegmatite_clk_stats(nb);
+	struct clk_notifier_data *ndata = data;
+	ktime_t now = ktime_get();
+
+	switch (event) {
+	case PRE_RATE_CHANGE:
+		/*
+		 * The core doesn't send a post-change notification to a clock
+		 * whose rate ended up unchanged, so a pre-change after posts
+		 * have started means the last transition is over
+		 */
+		if (transition.posting)
+			pegmatite_clk_transition_end(transition.last_post);
+
+		if (!transition.pending) {
+			transition.top = stats;
+			transition.old_rate = ndata->old_rate;
+			transition.new_rate = ndata->new_rate;
+			transition.start = now;
+			transition.num_clks = 0;
+		}
+		transition.pending++;
+		transition.num_clks++;
+		break;
+
+	case POST_RATE_CHANGE:
+		if (!transition.pending)
+			break;
+
+		transition.posting = true;
+		transition.last_post = now;
+		if (--transition.pending == 0)
+			pegmatite_clk_transition_end(now);
+		break;
+
+	case ABORT_RATE_CHANGE:
+		transition.top = NULL;
+		transition.pending = 0;
+		transition.posting = false;
+		break;
+	}
+
+	return NOTIFY_OK;
+}
+
+static int pegmatite_clk_stats_show(struct seq_file *s, void *unused)
+{
+	struct pegmatite_clk_stats *stats = s->private;
+	struct pegmatite_clk_hist *hist;
+	unsigned int i, b;
+	bool used;
+
+	for (i = 0; i < STATS_NR_HISTS; i++) {
+		hist = &stats->hist[i];
+		seq_printf(s, "%-9s count %llu avg %llu ns max %llu ns\n",
+			   stats_hist_names[i], hist->count,
+			   hist->count ? div64_u64(hist->total_ns, hist->count) : 0,
+			   hist->max_ns);
+	}
+
+	seq_printf(s, "\n%12s", "ns <");
+	for (i = 0; i < STATS_NR_HISTS; i++)
+		seq_printf(s, " %9s", stats_hist_names[i]);
+	seq_puts(s, "\n");
+
+	for (b = 0; b < STATS_HIST_BUCKETS; b++) {
+		used = false;
+		for (i = 0; i < STATS_NR_HISTS; i++)
+			used |= stats->hist[i].buckets[b] != 0;
+		if (!used)
+			continue;
+
+		if (b == STATS_HIST_BUCKETS - 1)
+			seq_printf(s, "%12s", "inf");
+		else
+			seq_printf(s, "%12llu", 1ULL << b);
+		for (i = 0; i < STATS_NR_HISTS; i++)
+			seq_printf(s, " %9u", stats->hist[i].buckets[b]);
+		seq_puts(s, "\n");
+	}
+
+	return 0;
+}
+
+static int pegmatite_clk_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pegmatite_clk_stats_show, inode->i_private);
+}
+
+static ssize_t pegmatite_clk_stats_write(struct file *file, const char __user *buf,
+					 size_t count, loff_t *ppos)
+{
+	struct pegmatite_clk_stats *stats = file_inode(file)->i_private;
+
+	memset(stats->hist, 0, sizeof(stats->hist));
+
+	return count;
+}
+
+static const struct file_operations pegmatite_clk_stats_fops = {
+	.open		= pegmatite_clk_stats_open,
+	.read		= seq_read,
+	.write		= pegmatite_clk_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void pegmatite_clk_stats_add_file(struct pegmatite_clk_stats *stats)
+{
+	debugfs_create_file(__clk_get_name(stats->hw->clk), S_IRUGO | S_IWUSR,
+			    stats_dir, stats, &pegmatite_clk_stats_fops);
+}
+
+/*
+ * Called once the clock is registered
+ */
+struct pegmatite_clk_stats *pegmatite_clk_stats_register(struct clk_hw *hw)
+{
+	struct pegmatite_clk_stats *stats;
+
+	stats = kzalloc(sizeof(*stats), GFP_KERNEL);
+	if (!stats) {
+		pr_err("%s: could not allocate clk stats\n", __func__);
+		return NULL;
+	}
+
+	stats->hw = hw;
+	stats->nb.notifier_call = pegmatite_clk_stats_notify;
+	if (clk_notifier_register(hw->clk, &stats->nb))
+		pr_err("%s: %s: no subtree timing\n", __func__, __clk_get_name(hw->clk));
+
+	mutex_lock(&stats_mutex);
+	list_add_tail(&stats->node, &stats_list);
+	if (stats_dir)
+		pegmatite_clk_stats_add_file(stats);
+	mutex_unlock(&stats_mutex);
+
+	return stats;
+}
+
+/*
+ * The clocks register before debugfs is up, so their files are made here
+ */
+static int __init pegmatite_clk_stats_init(void)
+{
+	struct pegmatite_clk_stats *stats;
+
+	mutex_lock(&stats_mutex);
+
+	stats_dir = debugfs_create_dir("pegmatite-clk", NULL);
+	if (IS_ERR_OR_NULL(stats_dir)) {
+		stats_dir = NULL;
+		mutex_unlock(&stats_mutex);
+		return 0;
+	}
+
+	list_for_each_entry(stats, &stats_list, node)
+		pegmatite_clk_stats_add_file(stats);
+
+	mutex_unlock(&stats_mutex);
+
+	return 0;
+}
+late_initcall(pegmatite_clk_stats_init);
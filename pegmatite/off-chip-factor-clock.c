@@ -6,6 +6,9 @@
 #include <linux/of.h>
 #include <linux/io.h>
 
+#include "clk-pegmatite.h"
+#include "clk-pegmatite-math.h"
+
 #define to_pegmatite_oc_factor(_hw) container_of(_hw, struct pegmatite_oc_factor, hw)
 struct pegmatite_oc_factor {
 	struct clk_hw		hw;
@@ -24,44 +27,15 @@ static unsigned long pegmatite_oc_factor_recalc_rate(struct clk_hw *hw, unsigned
 static int pegmatite_oc_factor_set_rate(struct clk_hw *hw, unsigned long rate, unsigned long parent_rate)
 {
 	struct pegmatite_oc_factor *oc_factor = to_pegmatite_oc_factor(hw);
-	unsigned int mult = 1;
-
-	if (rate < parent_rate) {
-		rate = parent_rate;
-	}
-
-	mult = rate / parent_rate;
-	if (rate % parent_rate)
-	{
-		if (abs(rate - parent_rate * mult) >
-			abs(rate - parent_rate * (mult + 1))) {
-			mult++;
-		}
-	}
 
-	oc_factor->mult = mult;
+	oc_factor->mult = pegmatite_oc_factor_calc_mult(rate, parent_rate);
 
 	return 0;
 }
 
 static long pegmatite_oc_factor_round_rate(struct clk_hw *hw, unsigned long rate, unsigned long *parent_rate)
 {
-	unsigned int mult = 1;
-
-	if (rate < *parent_rate) {
-		return *parent_rate;
-	}
-
-	mult = rate / *parent_rate;
-	if (rate % *parent_rate)
-	{
-		if (abs(rate - *parent_rate * mult) >
-			abs(rate - *parent_rate * (mult + 1))) {
-			mult++;
-		}
-	}
-
-	return *parent_rate * mult;
+	return *parent_rate * pegmatite_oc_factor_calc_mult(rate, *parent_rate);
 }
 
 const struct clk_ops pegmatite_oc_factor_ops = {
@@ -122,9 +96,8 @@ static void __init of_oc_factor_clk_setup(struct device_node *node)
 
 	of_clk_add_provider(node, of_clk_src_simple_get, clk);
 
-	/* If a default rate was specified in the device tree, set it here */
-	if(default_rate > 0)
-		clk_set_rate(clk, default_rate);
+	/* Hand the default rate (if any) to the clock plan, which sets it here unless a plan is in use */
+	pegmatite_clk_plan_add(&oc_factor->hw, &pegmatite_oc_factor_ops, default_rate);
 
 	return;
 free_out2:
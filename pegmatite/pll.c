@@ -13,6 +13,12 @@
 #include <linux/of.h>
 #include <linux/io.h>
 #include <linux/delay.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/init.h>
+
+#include "clk-pegmatite.h"
+#include "clk-pegmatite-math.h"
 
 #define REFDIV_MASK 0x1ff
 #define REFDIV_SHIFT 0
@@ -78,14 +84,39 @@ struct pll_regs {
 	volatile uint32_t reserve_out;
 };
 
+#define PLL_NUM_REGS (sizeof(struct pll_regs) / sizeof(uint32_t))
+
+/*
+ * Everything but lock_state only changes when we write it, so it is served
+ * from the shadow cache
+ */
+#define pll_readl(_pll, _reg) \
+	pegmatite_regcache_read(&(_pll)->cache, offsetof(struct pll_regs, _reg))
+#define pll_writel(_pll, _val, _reg) \
+	pegmatite_regcache_write(&(_pll)->cache, _val, offsetof(struct pll_regs, _reg))
+
 #define to_pegmatite_pll(_hw) container_of(_hw, struct pegmatite_pll, hw)
 struct pegmatite_pll {
 	struct clk_hw		hw;
 	struct pll_regs		*regs;
+	struct pegmatite_regcache cache;
 	int			predivider;
 	unsigned int		deskew;
+	bool			defer_lock;	/* don't wait for lock while unprepared */
+	bool			critical;	/* feeds the cpu or dram, never deferred */
+	bool			lock_pending;
+	struct list_head	lock_node;
+	struct pegmatite_clk_stats *stats;
 };
 
+/*
+ * Plls that have been programmed but not yet waited on.  They stay in
+ * bypass until pegmatite_pll_wait_pending() or their first prepare.
+ */
+static LIST_HEAD(pll_lock_list);
+static DEFINE_MUTEX(pll_lock_mutex);
+static bool pll_lock_deferred;
+
 static unsigned long pegmatite_pll_recalc_rate(struct clk_hw *hw, unsigned long parent_rate)
 {
 	struct pegmatite_pll *pll = to_pegmatite_pll(hw);
@@ -97,14 +128,14 @@ static unsigned long pegmatite_pll_recalc_rate(struct clk_hw *hw, unsigned long
 	unsigned int freq_offset_en;
 	unsigned int fbdiv;
 	unsigned int calc_rate;
-	u64 calc_rate_64;
 	int val;
 
 	/*
-	 * If the pll is in bypass, then return the parent_rate
+	 * If the pll is in bypass, then return the parent_rate.  A pll waiting
+	 * for lock is still in bypass, but reports the rate it was programmed to.
 	 */
-	val = readl(&pll->regs->fixed_mode_ssc_mode);
-	if(val & (BYPASS_EN_MASK << BYPASS_EN_SHIFT)) {
+	val = pll_readl(pll, fixed_mode_ssc_mode);
+	if((val & (BYPASS_EN_MASK << BYPASS_EN_SHIFT)) && !pll->lock_pending) {
 		pr_err("%s: %s is in bypass!\n", __func__, __clk_get_name(hw->clk));
 		return parent_rate;
 	}
@@ -120,7 +151,7 @@ static unsigned long pegmatite_pll_recalc_rate(struct clk_hw *hw, unsigned long
 	/*
 	 * If the pll is in reset, then return zero
 	 */
-	val = readl(&pll->regs->rst_prediv);
+	val = pll_readl(pll, rst_prediv);
 	if(val & (RESET_MASK << RESET_SHIFT)) {
 		pr_err("%s: %s is in reset!\n", __func__, __clk_get_name(hw->clk));
 		return 0;
@@ -134,20 +165,20 @@ static unsigned long pegmatite_pll_recalc_rate(struct clk_hw *hw, unsigned long
 	/*
 	 * Get the Post Divider For Single-ended Output and the Feedback Divider
 	 */
-	val = readl(&pll->regs->mult_postdiv);
+	val = pll_readl(pll, mult_postdiv);
 	clkout_div_sel = (val >> CLKOUT_SE_DIV_SEL_SHIFT) & CLKOUT_SE_DIV_SEL_MASK;
 	fbdiv = (val >> FBDIV_SHIFT) & FBDIV_MASK;
 
 	/*
 	 * Get the Source Select
 	 */
-	val = readl(&pll->regs->clk_control_marvell_test);
+	val = pll_readl(pll, clk_control_marvell_test);
 	clkout_source_sel = (val >> CLKOUT_SOURCE_SEL_SHIFT) & CLKOUT_SOURCE_SEL_MASK;
 
 	/*
 	 * Get the Frequency Offset Enable and (maybe) the Frequency Offset
 	 */
-	val = readl(&pll->regs->offset_mode);
+	val = pll_readl(pll, offset_mode);
 	freq_offset_en = (val >> FREQ_OFFSET_EN_SHIFT) & FREQ_OFFSET_EN_MASK;
 	if(freq_offset_en) {
 		freq_offset = (val >> FREQ_OFFSET_SHIFT) & FREQ_OFFSET_MASK;
@@ -161,110 +192,249 @@ static unsigned long pegmatite_pll_recalc_rate(struct clk_hw *hw, unsigned long
 	/*
 	 * Calculate the rate (w/o frequency offset)
 	 */
-	if(pll->deskew) {
-		calc_rate_64 = (u64)parent_rate * fbdiv;
-		do_div(calc_rate_64, refdiv * vcodiv);
-		calc_rate = (unsigned int)calc_rate_64;
+	calc_rate = pegmatite_pll_calc_rate(parent_rate, refdiv, fbdiv, vcodiv, pll->deskew);
+	if(pll->deskew)
 		return calc_rate;
-	} else {
-		calc_rate_64 = (u64)parent_rate * 4 * fbdiv;
-		do_div(calc_rate_64, (refdiv * vcodiv));
-		calc_rate = (unsigned int)calc_rate_64;
-	}
+
+	return pegmatite_pll_apply_freq_offset(calc_rate, freq_offset);
+}
+
+/*
+ * Retune a running pll by changing only its Frequency Offset.  The reference
+ * and feedback dividers stay as they are, so the pll never goes through
+ * bypass, reset and relock.  This works when the requested rate is within
+ * the +/- 5% the offset can cover from the current integer rate, which is
+ * the case for neighbouring cpu operating points.
+ * Returns -EINVAL when a full reprogram is needed instead.
+ */
+static int pegmatite_pll_retune(struct pegmatite_pll *pll, unsigned long rate, unsigned long parent_rate)
+{
+	unsigned int refdiv, fbdiv, vcodiv;
+	unsigned int calc_rate;
+	unsigned int freq_offset;
+	int val;
+
+	if(pll->deskew || rate == 0)
+		return -EINVAL;
+
+	/*
+	 * The pll has to be powered up, out of bypass and out of reset,
+	 * with the Frequency Offset and Phase Interpolator Loop enabled
+	 */
+	val = pll_readl(pll, fixed_mode_ssc_mode);
+	if((val & (BYPASS_EN_MASK << BYPASS_EN_SHIFT)) ||
+	   (val & (PU_MASK << PU_SHIFT)) != (PU_MASK << PU_SHIFT))
+		return -EINVAL;
+
+	val = pll_readl(pll, rst_prediv);
+	if(val & (RESET_MASK << RESET_SHIFT))
+		return -EINVAL;
+	refdiv = (val >> REFDIV_SHIFT) & REFDIV_MASK;
+
+	val = pll_readl(pll, offset_mode);
+	if(!(val & (FREQ_OFFSET_EN_MASK << FREQ_OFFSET_EN_SHIFT)) ||
+	   !(val & (PI_LOOP_MODE_MASK << PI_LOOP_MODE_SHIFT)))
+		return -EINVAL;
+
+	val = pll_readl(pll, mult_postdiv);
+	vcodiv = 1 << ((val >> CLKOUT_SE_DIV_SEL_SHIFT) & CLKOUT_SE_DIV_SEL_MASK);
+	fbdiv = (val >> FBDIV_SHIFT) & FBDIV_MASK;
+	if(refdiv == 0 || fbdiv == 0)
+		return -EINVAL;
+
+	/*
+	 * Current output rate w/o any Frequency Offset.  The offset is the
+	 * one between the two output rates, exactly as pegmatite_pll_set_rate
+	 * computes it, so both paths program the same offset for the same
+	 * target rate.
+	 */
+	calc_rate = pegmatite_pll_calc_rate(parent_rate, refdiv, fbdiv, vcodiv, 0);
+
+	/*
+	 * The offset can only make up +/- 5%
+	 */
+	if(!pegmatite_pll_offset_reachable(calc_rate, rate))
+		return -EINVAL;
+
+	freq_offset = pegmatite_pll_rate_offset(calc_rate, rate, 0);
 
 	/*
-	 * If there is a Frequency Offset value, determine the offset percent to apply to the calculated clock rate
-	 * The formula to calculate freq_offset is freq_offset[15:0] = 2^20 * (abs(offset_percent) / (1 + offset_percent))
-	 * We are basically doing the opposite here to determine the offset_percent from freq_offset
+	 * Drop Frequency Offset Valid while the new offset is written, then
+	 * set it again to latch the offset
 	 */
+	val = pll_readl(pll, offset_mode);
+	val &= ~(FREQ_OFFSET_MASK << FREQ_OFFSET_SHIFT);
+	val &= ~(FREQ_OFFSET_VALID_MASK << FREQ_OFFSET_VALID_SHIFT);
+	pll_writel(pll, val, offset_mode);
 	if(freq_offset) {
-		s64 offset_percent;
-		s64 divider;
-		s64 freq_bump;
-
-		/*
-		 * Use the first 16 bits of freq_offset to calculate the offset percentage
-		 */
-		offset_percent = (s64) freq_offset & 0xffff;
-
-		/*
-		 * The divider is 2^20 + freq_offset
-		 */
-		divider = 1048576 + offset_percent;
-
-		/*
-		 * Since we can't do floating point math in the kernel we multiple by 100000000
-		 */
-		offset_percent *= 100000000;
-
-		/*
-		 * Divide our offset_percent (so far) by the divider
-		 */
-		offset_percent = div_s64(offset_percent, divider);
-
-		/*
-		 * Multiple the offset percentage by the calculated rate and then divide by 100000000 (to undo the multiply we did earlier)
-		 */
-		freq_bump = div_s64((calc_rate * offset_percent), 100000000);
-
-		/*
-		 * Bit 17 of freq_offset is the sign of the offset percentage
-		 */
-		if(freq_offset & 0x10000) {
-			calc_rate += freq_bump;
-		} else {
-			calc_rate -= freq_bump;
+		val |= ((freq_offset & FREQ_OFFSET_MASK) << FREQ_OFFSET_SHIFT);
+		val |= (FREQ_OFFSET_VALID_MASK << FREQ_OFFSET_VALID_SHIFT);
+		pll_writel(pll, val, offset_mode);
+	}
+
+	return 0;
+}
+
+/*
+ * Take the pll out of bypass and disable phase interpolator if in deskew mode
+ */
+static void pegmatite_pll_unbypass(struct pegmatite_pll *pll)
+{
+	int val;
+
+	val = pll_readl(pll, fixed_mode_ssc_mode);
+	val &= ~(BYPASS_EN_MASK << BYPASS_EN_SHIFT);
+	if(pll->deskew) {
+		val &= ~(PI_EN_MASK << PI_EN_SHIFT);
+		val &= ~CLK_DET_MASK;
+	}
+	pll_writel(pll, val, fixed_mode_ssc_mode);
+}
+
+/*
+ * Lock polling step.  set_rate can run from CLK_OF_DECLARE and the pm code
+ * from syscore, neither of which may sleep, so only callers that know they
+ * can sleep ask for it.
+ */
+static void pegmatite_pll_lock_delay(bool sleep)
+{
+	if(sleep)
+		usleep_range(10, 20);
+	else
+		udelay(10);
+}
+
+static void pegmatite_pll_wait_lock(struct pegmatite_pll *pll, bool sleep)
+{
+	unsigned int timeout = 1000;
+
+	while(!(readl(&pll->regs->lock_state) & PLL_LOCK_MASK)) {
+		if(timeout-- == 0) {
+			pr_err("%s: %s failed to lock\n", __func__, __clk_get_name(pll->hw.clk));
+			break;
+		}
+		pegmatite_pll_lock_delay(sleep);
+	}
+
+	pegmatite_pll_unbypass(pll);
+}
+
+/*
+ * Wait for every pll kicked while the lock wait was deferred.  The plls lock
+ * in parallel, so this costs one lock time rather than one per pll.
+ */
+static void pegmatite_pll_wait_list(bool sleep)
+{
+	struct pegmatite_pll *pll, *tmp;
+	unsigned int timeout = 1000;
+	bool pending;
+
+	do {
+		pending = false;
+		list_for_each_entry_safe(pll, tmp, &pll_lock_list, lock_node) {
+			if(readl(&pll->regs->lock_state) & PLL_LOCK_MASK) {
+				pegmatite_pll_unbypass(pll);
+				list_del_init(&pll->lock_node);
+				pll->lock_pending = false;
+			}
+			else {
+				pending = true;
+			}
 		}
+		if(pending)
+			pegmatite_pll_lock_delay(sleep);
+	} while(pending && timeout-- > 0);
+
+	/*
+	 * As in the single pll case, a pll that never locks is taken out of
+	 * bypass anyway
+	 */
+	list_for_each_entry_safe(pll, tmp, &pll_lock_list, lock_node) {
+		pr_err("%s: %s failed to lock\n", __func__, __clk_get_name(pll->hw.clk));
+		pegmatite_pll_unbypass(pll);
+		list_del_init(&pll->lock_node);
+		pll->lock_pending = false;
+	}
+}
+
+void __pegmatite_pll_wait_pending(void)
+{
+	pegmatite_pll_wait_list(false);
+}
+
+/*
+ * The clock plan calls this from CLK_OF_DECLARE, so it busy-waits
+ */
+void pegmatite_pll_wait_pending(void)
+{
+	mutex_lock(&pll_lock_mutex);
+	pegmatite_pll_wait_list(false);
+	mutex_unlock(&pll_lock_mutex);
+}
+
+/*
+ * While deferred, set_rate programs the pll and returns without waiting for
+ * lock.  Used by the clock plan to bring all plls up together.
+ */
+void pegmatite_pll_defer_lock(bool defer)
+{
+	mutex_lock(&pll_lock_mutex);
+	pll_lock_deferred = defer;
+	mutex_unlock(&pll_lock_mutex);
+}
+
+/*
+ * A consumer is about to use the pll, so a pending lock has to finish now.
+ * Prepare may sleep, except for timer clocks prepared from time_init
+ * while irqs are still off.
+ */
+static int pegmatite_pll_prepare(struct clk_hw *hw)
+{
+	struct pegmatite_pll *pll = to_pegmatite_pll(hw);
+
+	mutex_lock(&pll_lock_mutex);
+	if(pll->lock_pending) {
+		pegmatite_pll_wait_lock(pll, !early_boot_irqs_disabled);
+		list_del_init(&pll->lock_node);
+		pll->lock_pending = false;
 	}
-	return calc_rate;
+	mutex_unlock(&pll_lock_mutex);
+
+	return 0;
 }
 
 static int pegmatite_pll_set_rate(struct clk_hw *hw, unsigned long rate, unsigned long parent_rate)
 {
 	struct pegmatite_pll *pll = to_pegmatite_pll(hw);
 	unsigned int pll_bw_sel = 0;
-	unsigned int refdiv = 1;
-	unsigned int best_refdiv;
+	unsigned int refdiv;
 	unsigned int icp = 0;
 	unsigned int vcodiv;
 	unsigned int clkout_div_sel = 0;
 	unsigned int kvco = 0;
 	unsigned int fbdiv;
 	unsigned int calc_rate;
-	unsigned int best_calc_rate;
 	unsigned int freq_offset = 0;
 	unsigned int fvco;
 	unsigned int frefdiv;
-	unsigned int timeout = 1000;
 	int val;
-	u64 calc_rate_64;
-
-	vcodiv = 1;
-	if (pll->deskew) {
-		/*
-		 * Default vcodiv to 1 and then increment until the vco frequency
-		 * is closest to 3GHz without going over
-		 */
-		if (rate > 0)
-		{
-			while((unsigned long long)rate * vcodiv <= 3000000000ull) {
-				vcodiv *= 2;
-			}
-			vcodiv /= 2;
-		}
-	}
-	else {
-		/*
-		 * Default vcodiv to 1 and then increment until the vco frequency
-		 * is greater than 1GHz and less than 4GHz
-		 */
-		vcodiv = 1;
-		while(((unsigned long long)rate * vcodiv < 1000000000ull) ||
-			  ((unsigned long long)rate * vcodiv > 4000000000ull)) {
-			vcodiv++;
-		}
+
+	pegmatite_clk_stats_start(pll->stats);
+
+	/*
+	 * Small changes only need a new Frequency Offset
+	 */
+	if(pegmatite_pll_retune(pll, rate, parent_rate) == 0) {
+		pegmatite_clk_stats_phase(pll->stats, PEGMATITE_CLK_PROGRAM);
+		pegmatite_clk_stats_end(pll->stats, rate);
+		return 0;
 	}
 
+	/*
+	 * Post divider for the requested rate, see pegmatite_pll_calc_vcodiv
+	 */
+	vcodiv = pegmatite_pll_calc_vcodiv(rate, pll->deskew);
+
 	/*
 	 * Set the Post Divider Single-ended Divide based on vcodiv
 	 * These values come from the PLL spec
@@ -324,14 +494,9 @@ static int pegmatite_pll_set_rate(struct clk_hw *hw, unsigned long rate, unsigne
 	}
 
 	/*
-	 * Increment the reference divider until parent_rate divided by the
-	 * reference divider is greater than or equal to 8Mhz and less that
-	 * or equal to 32MHz
+	 * Pick the reference divider whose output comes closest to rate
 	 */
-	while(parent_rate/refdiv > 32000000) {
-		refdiv++;
-	}
-	best_refdiv = refdiv;
+	refdiv = pegmatite_pll_best_refdiv(rate, parent_rate, vcodiv, pll->deskew);
 
 	/*
 	 * frefdiv is our divided reference rate
@@ -341,87 +506,12 @@ static int pegmatite_pll_set_rate(struct clk_hw *hw, unsigned long rate, unsigne
 	/*
 	 * Calculate the Feedback Divider
 	 */
-	if(pll->deskew) {
-		fbdiv = (fvco / (frefdiv * vcodiv));
-	} else {
-		fbdiv = (fvco / 4) / frefdiv;
-	}
+	fbdiv = pegmatite_pll_calc_fbdiv(fvco, frefdiv, vcodiv, pll->deskew);
 
 	/*
 	 * Calculate the output rate (w/o any Frequency Offset)
 	 */
-	if(pll->deskew) {
-		calc_rate_64 = (u64)parent_rate * fbdiv;
-	} else {
-		calc_rate_64 = (u64)parent_rate * 4 * fbdiv;
-	}
-	do_div(calc_rate_64, refdiv * vcodiv);
-	best_calc_rate = (unsigned int)calc_rate_64;
-
-	/*
-	 * Test calc_rate at refdivs within the pll's range.
-	 */
-	refdiv++;
-
-	while(parent_rate/refdiv >= 8000000) {
-		/*
-		 * frefdiv is our divided reference rate
-		 */
-		frefdiv = parent_rate / refdiv;
-
-		/*
-		 * Calculate the Feedback Divider
-		 */
-		if(pll->deskew) {
-			fbdiv = (fvco / (frefdiv * vcodiv));
-		} else {
-			fbdiv = (fvco / 4) / frefdiv;
-		}
-
-
-		/*
-		 * Calculate the output rate (w/o any Frequency Offset)
-		 */
-		if(pll->deskew) {
-			calc_rate_64 = (u64)parent_rate * fbdiv;
-		} else {
-			calc_rate_64 = (u64)parent_rate * 4 * fbdiv;
-		}
-		do_div(calc_rate_64, refdiv * vcodiv);
-		calc_rate = (unsigned int)calc_rate_64;
-		if(abs(best_calc_rate - rate) > abs(calc_rate - rate))
-		{
-			best_refdiv = refdiv;
-			best_calc_rate = calc_rate;
-		}
-		refdiv++;
-	}
-	refdiv = best_refdiv;
-
-	/*
-	 * frefdiv is our divided reference rate
-	 */
-	frefdiv = parent_rate / refdiv;
-
-	/*
-	 * Calculate the Feedback Divider
-	 */
-	if(pll->deskew) {
-		fbdiv = (fvco / (frefdiv * vcodiv));
-	} else {
-		fbdiv = (fvco / 4) / frefdiv;
-	}
-
-	/*
-	 * Calculate the output rate (w/o any Frequency Offset)
-	 */
-	if(pll->deskew) {
-		calc_rate_64 = (u64)parent_rate * fbdiv;
-	} else {
-		calc_rate_64 = (u64)parent_rate * 4 * fbdiv;
-	}
-	do_div(calc_rate_64, refdiv * vcodiv);
-	calc_rate = (unsigned int)calc_rate_64;
+	calc_rate = pegmatite_pll_calc_rate(parent_rate, refdiv, fbdiv, vcodiv, pll->deskew);
 
 	/*
 	 * Set the Charge Pump Current based on Pll Bandwidth Select and frefdiv
@@ -456,103 +546,51 @@ static int pegmatite_pll_set_rate(struct clk_hw *hw, unsigned long rate, unsigne
 
 	/*
 	 * If the calculated rate doesn't match the requested rate, apply
-	 * a Frequency Offset to make up the difference
-	 * Offset percent is calculated by (calc_rate - fvco) / fvco
-	 * The formula to calculate freq_offset is freq_offset[15:0] = 2^20 * (abs(offset_percent) / (1 + offset_percent))
-	 */
-	if(calc_rate != rate && !pll->deskew) {
-		s64 offset_percent;
-		s64 divider;
-
-		/*
-		 * Start with our calculated rate
-		 */
-		offset_percent = (s64)(calc_rate);
-
-		/*
-		 * Subtract fvco
-		 */
-		offset_percent -= fvco;
-
-		/*
-		 * Since we can't do any floating point math in the kernel, multiply by 100000000
-		 */
-		offset_percent *= 100000000;
-
-		/*
-		 * Divide by fvco
-		 */
-		offset_percent = div_s64(offset_percent, fvco);
-
-		/*
-		 * Bit 17 of freq_offset is the sign of the offset percentage
-		 */
-		if(offset_percent > 0) {
-			freq_offset = 0;
-		} else {
-			freq_offset = 0x10000;
-		}
-
-		/*
-		 * The divider is supposed to be (1 + offset_percent), but since we multiplied by 100000000
-		 * it needs to be (100000000 + offset_percent)
-		 */
-		divider = 100000000 + offset_percent;
-
-		/*
-		 * Get the absolute value of offset_percent
-		 */
-		offset_percent = abs64(offset_percent);
-
-		/*
-		 * Multiply by 2^20
-		 */
-		offset_percent *= 1048576;
-
-		/*
-		 * Divide by the divider to get freq_offset
-		 */
-		offset_percent = div_s64(offset_percent, divider);
+	 * a Frequency Offset to make up the difference.  The offset is
+	 * relative to the output rate, and only covers +/- 5%; beyond that
+	 * the pll runs at calc_rate, which is also what round_rate reports.
+	 */
+	freq_offset = pegmatite_pll_rate_offset(calc_rate, rate, pll->deskew);
 
-		freq_offset |= 0xffff & (unsigned int)offset_percent;
-	}
+	pegmatite_clk_stats_phase(pll->stats, PEGMATITE_CLK_SOLVE);
 
 	/*
 	 * Enable bypass while we set up the pll
 	 */
-	val = readl(&pll->regs->fixed_mode_ssc_mode);
+	val = pll_readl(pll, fixed_mode_ssc_mode);
 	val |= (BYPASS_EN_MASK << BYPASS_EN_SHIFT);
-	writel(val, &pll->regs->fixed_mode_ssc_mode);
+	pll_writel(pll, val, fixed_mode_ssc_mode);
 
 	/*
 	 * Put the pll in reset
 	 */
-	val = readl(&pll->regs->rst_prediv);
+	val = pll_readl(pll, rst_prediv);
 	val |= (RESET_MASK << RESET_SHIFT);
 	val |= (RESET_PI_MASK << RESET_PI_SHIFT);
 	val |= (RESET_SSC_MASK << RESET_SSC_SHIFT);
-	writel(val, &pll->regs->rst_prediv);
+	pll_writel(pll, val, rst_prediv);
 
 	/*
 	 * Power up and pi_en
 	 */
-	val = readl(&pll->regs->fixed_mode_ssc_mode);
+	val = pll_readl(pll, fixed_mode_ssc_mode);
 	val |= (PU_MASK << PU_SHIFT);
 	val |= (PI_EN_MASK << PI_EN_SHIFT);
-	writel(val, &pll->regs->fixed_mode_ssc_mode);
+	pll_writel(pll, val, fixed_mode_ssc_mode);
+	pegmatite_clk_stats_phase(pll->stats, PEGMATITE_CLK_BYPASS);
 
 	/*
 	 * Set the reference divider
 	 */
-	val = readl(&pll->regs->rst_prediv);
+	val = pll_readl(pll, rst_prediv);
 	val &= ~(REFDIV_MASK << REFDIV_SHIFT);
 	val |= ((refdiv & REFDIV_MASK) << REFDIV_SHIFT);
-	writel(val, &pll->regs->rst_prediv);
+	pll_writel(pll, val, rst_prediv);
 
 	/*
 	 * Set ICP and Pll Bandwidth Select
 	 */
-	val = readl(&pll->regs->misc);
+	val = pll_readl(pll, misc);
 	val &= ~(PLL_BW_SEL_MASK << PLL_BW_SEL_SHIFT);
 	val &= ~(ICP_MASK << ICP_SHIFT);
 	val |= ((pll_bw_sel & PLL_BW_SEL_MASK) << PLL_BW_SEL_SHIFT);
@@ -560,35 +598,35 @@ static int pegmatite_pll_set_rate(struct clk_hw *hw, unsigned long rate, unsigne
 	if(pll->deskew) {
 		val |= ((VDDL_DESKEW_MASK) << VDDL_SHIFT);
 	}
-	writel(val, &pll->regs->misc);
+	pll_writel(pll, val, misc);
 
 	/*
 	 * Set Post Divider For Single-ended Ouput and Feedback Divider
 	 */
-	val = readl(&pll->regs->mult_postdiv);
+	val = pll_readl(pll, mult_postdiv);
 	val &= ~(CLKOUT_SE_DIV_SEL_MASK << CLKOUT_SE_DIV_SEL_SHIFT);
 	val &= ~(CLKOUT_DIFF_DIV_SEL_MASK << CLKOUT_DIFF_DIV_SEL_SHIFT);
 	val &= ~(FBDIV_MASK << FBDIV_SHIFT);
 	val |= ((clkout_div_sel & CLKOUT_SE_DIV_SEL_MASK) << CLKOUT_SE_DIV_SEL_SHIFT);
 	val |= ((clkout_div_sel & CLKOUT_DIFF_DIV_SEL_MASK) << CLKOUT_DIFF_DIV_SEL_SHIFT);
 	val |= ((fbdiv & FBDIV_MASK) << FBDIV_SHIFT);
-	writel(val, &pll->regs->mult_postdiv);
+	pll_writel(pll, val, mult_postdiv);
 
 	/*
 	 * Set Source Select
 	 */
-	val = readl(&pll->regs->clk_control_marvell_test);
+	val = pll_readl(pll, clk_control_marvell_test);
 	val |= (CLKOUT_SOURCE_SEL_MASK << CLKOUT_SOURCE_SEL_SHIFT);
 	if(pll->deskew) {
 		val |= (CLKOUT_DIF_EN_MASK << CLKOUT_DIF_EN_SHIFT);
 	}
-	writel(val, &pll->regs->clk_control_marvell_test);
+	pll_writel(pll, val, clk_control_marvell_test);
 
 	/*
 	 * Set Frequency Offset Enable, Frequency Offset Valid, Frequency Offset (maybe)
 	 * and Phase Interpolator Loop Control
 	 */
-	val = readl(&pll->regs->offset_mode);
+	val = pll_readl(pll, offset_mode);
 	if(!pll->deskew) {
 		val &= ~(FREQ_OFFSET_MASK << FREQ_OFFSET_SHIFT);
 		val &= ~(FREQ_OFFSET_VALID_MASK << FREQ_OFFSET_VALID_SHIFT);
@@ -603,59 +641,68 @@ static int pegmatite_pll_set_rate(struct clk_hw *hw, unsigned long rate, unsigne
 		val &= ~(FREQ_OFFSET_INTPR_MASK << FREQ_OFFSET_INTPR_SHIFT);
 		val &= ~(FREQ_OFFSET_FD_MASK << FREQ_OFFSET_FD_SHIFT);
 	}
-	writel(val, &pll->regs->offset_mode);
+	pll_writel(pll, val, offset_mode);
 
 	/*
 	 * Clear ssc_freq_ssc_range
 	 */
-	writel(0, &pll->regs->ssc_freq_ssc_range);
+	pll_writel(pll, 0, ssc_freq_ssc_range);
 
 	/*
 	 * Set KVCO
 	 */
-	val = readl(&pll->regs->kvco);
+	val = pll_readl(pll, kvco);
 	val &= ~(KVCO_MASK << KVCO_SHIFT);
 	val |= ((kvco & KVCO_MASK) << KVCO_SHIFT);
-	writel(val, &pll->regs->kvco);
+	pll_writel(pll, val, kvco);
 
 	/*
 	 * Enable External Feedback Clock if applicable
 	 */
 	if(pll->deskew) {
-		val = readl(&pll->regs->feedback_mode_deskew);
+		val = pll_readl(pll, feedback_mode_deskew);
 		val |= (FBCLK_EXT_MSK << FBCLK_EXT_SHIFT);
-		writel(val, &pll->regs->feedback_mode_deskew);
+		pll_writel(pll, val, feedback_mode_deskew);
 	}
 
 	/*
 	 * Clear reset
 	 */
-	val = readl(&pll->regs->rst_prediv);
+	val = pll_readl(pll, rst_prediv);
 	val &= ~(RESET_MASK << RESET_SHIFT);
 	val &= ~(RESET_PI_MASK << RESET_PI_SHIFT);
 	val &= ~(RESET_SSC_MASK << RESET_SSC_SHIFT);
-	writel(val, &pll->regs->rst_prediv);
+	pll_writel(pll, val, rst_prediv);
+	pegmatite_clk_stats_phase(pll->stats, PEGMATITE_CLK_PROGRAM);
 
 	/*
-	 * Wait for lock
+	 * Wait for lock and take the pll out of bypass, unless that is
+	 * deferred.  A defer-lock pll that nobody has prepared yet waits
+	 * until its first prepare.  The cpu and dram plls run before anyone
+	 * prepares them, so a critical pll always waits here.
 	 */
-	while(!(readl(&pll->regs->lock_state) & PLL_LOCK_MASK)) {
-		if(timeout-- == 0) {
-			break;
+	mutex_lock(&pll_lock_mutex);
+	if(!pll->critical &&
+	   (pll_lock_deferred || (pll->defer_lock && !__clk_is_prepared(hw->clk)))) {
+		if(!pll->lock_pending) {
+			pll->lock_pending = true;
+			list_add_tail(&pll->lock_node, &pll_lock_list);
 		}
-		udelay(10);
 	}
+	else {
+		if(pll->lock_pending) {
+			list_del_init(&pll->lock_node);
+			pll->lock_pending = false;
+		}
+		pegmatite_pll_wait_lock(pll, false);
+	}
+	mutex_unlock(&pll_lock_mutex);
 
 	/*
-	 * Take the pll out of bypass and disable phase interpolator if in deskew mode
+	 * A deferred lock wait is not counted here
 	 */
-	val = readl(&pll->regs->fixed_mode_ssc_mode);
-	val &= ~(BYPASS_EN_MASK << BYPASS_EN_SHIFT);
-	if(pll->deskew) {
-		val &= ~(PI_EN_MASK << PI_EN_SHIFT);
-		val &= ~CLK_DET_MASK;
-	}
-	writel(val, &pll->regs->fixed_mode_ssc_mode);
+	pegmatite_clk_stats_phase(pll->stats, PEGMATITE_CLK_LOCK);
+	pegmatite_clk_stats_end(pll->stats, rate);
 
 	return 0;
 }
@@ -663,198 +710,109 @@ static int pegmatite_pll_set_rate(struct clk_hw *hw, unsigned long rate, unsigne
 static long pegmatite_pll_round_rate(struct clk_hw *hw, unsigned long rate, unsigned long *prate)
 {
 	struct pegmatite_pll *pll = to_pegmatite_pll(hw);
-	unsigned int refdiv;
-	unsigned int best_refdiv;
-	int vcodiv;
-	unsigned int fbdiv;
-	unsigned int calc_rate;
-	unsigned int best_calc_rate;
-	unsigned int fvco;
-	unsigned int frefdiv;
-	unsigned int parent_rate = *prate;
-	u64 calc_rate_64;
 
 	/*
-	 * Default the Reference Divider to 1
+	 * Same dividers as set_rate would pick, see pegmatite_pll_calc_round_rate
 	 */
-	refdiv = 1;
-	/*
-	 * Default vcodiv to 1
-	 */
-	vcodiv = 1;
+	return pegmatite_pll_calc_round_rate(rate, *prate, pll->deskew);
+}
 
-	if (pll->deskew) {
-		/*
-		 * Default vcodiv to 1 and then increment until the vco frequency
-		 * is closest to 3GHz without going over
-		 */
-		if (rate > 0)
-		{
-			while((unsigned long long)rate * vcodiv <= 3000000000ull) {
-				vcodiv *= 2;
-			}
-			vcodiv /= 2;
-		}
-	}
-	else {
-		/*
-		 * Increment until the vco frequency
-		 * is greater than 1GHz and less than 4GHz
-		 */
-		while(((unsigned long long)rate * vcodiv < 1000000000ull) ||
-			  ((unsigned long long)rate * vcodiv > 4000000000ull)) {
-			vcodiv++;
-		}
-	}
+static long pegmatite_pll_determine_rate(struct clk_hw *hw, unsigned long rate,
+					 unsigned long min_rate, unsigned long max_rate,
+					 unsigned long *best_parent_rate,
+					 struct clk_hw **best_parent_hw)
+{
+	struct clk *parent = __clk_get_parent(hw->clk);
 
 	/*
-	 * fvco is the target rate multiplied by vcodiv
+	 * The pll's parent is a fixed reference, so it never changes.
+	 * Just clamp the request to the allowed range and round it.
 	 */
-	fvco = rate * vcodiv;
+	if (parent)
+		*best_parent_hw = __clk_get_hw(parent);
 
-	/*
-	 * Increment the reference divider until parent_rate divided by the
-	 * reference divider is greater than or equal to 8Mhz and less that
-	 * or equal to 32MHz
-	 */
-	while(parent_rate/refdiv > 32000000) {
-		refdiv++;
-	}
-	best_refdiv = refdiv;
+	rate = clamp(rate, min_rate, max_rate);
+	if (rate == 0)
+		return 0;
 
-	/*
-	 * frefdiv is our divided reference rate
-	 */
-	frefdiv = parent_rate / refdiv;
+	return pegmatite_pll_round_rate(hw, rate, best_parent_rate);
+}
 
-	/*
-	 * Calculate the Feedback Divider
-	 */
-	if(pll->deskew) {
-		fbdiv = (fvco / (frefdiv * vcodiv));
-	} else {
-		fbdiv = (fvco / 4) / frefdiv;
-	}
+/*
+ * Does the hardware still hold the cached register image?
+ */
+static bool pegmatite_pll_matches_cache(struct pegmatite_pll *pll)
+{
+	unsigned int i;
 
-	/*
-	 * Calculate the output rate (w/o any Frequency Offset)
-	 */
-	if(pll->deskew) {
-		calc_rate_64 = (u64)parent_rate * fbdiv;
-	} else {
-		calc_rate_64 = (u64)parent_rate * 4 * fbdiv;
+	for (i = 0; i < PLL_NUM_REGS; i++) {
+		if (i == offsetof(struct pll_regs, lock_state) / 4)
+			continue;
+		if (readl_relaxed(pll->cache.base + i * 4) != pll->cache.vals[i])
+			return false;
 	}
-	do_div(calc_rate_64, refdiv * vcodiv);
-	best_calc_rate = (unsigned int)calc_rate_64;
-
-	/*
-	 * Test calc_rate at refdivs within the pll's range.
-	 */
-	refdiv++;
-	while(parent_rate/refdiv >= 8000000) {
-		/*
-		 * frefdiv is our divided reference rate
-		 */
-		frefdiv = parent_rate / refdiv;
-
-		/*
-		 * Calculate the Feedback Divider
-		 */
-		if(pll->deskew) {
-			fbdiv = (fvco / (frefdiv * vcodiv));
-		} else {
-			fbdiv = (fvco / 4) / frefdiv;
-		}
 
-		/*
-		 * Calculate the output rate (w/o any Frequency Offset)
-		 */
-		if(pll->deskew) {
-			calc_rate_64 = (u64)parent_rate * fbdiv;
-		} else {
-			calc_rate_64 = (u64)parent_rate * 4 * fbdiv;
-		}
-		do_div(calc_rate_64, refdiv * vcodiv);
-		calc_rate = (unsigned int)calc_rate_64;
-		if(abs(best_calc_rate - rate) > abs(calc_rate - rate))
-		{
-			best_refdiv = refdiv;
-			best_calc_rate = calc_rate;
-		}
-		refdiv++;
-	}
-	refdiv = best_refdiv;
+	return true;
+}
 
-	/*
-	 * frefdiv is our divided reference rate
-	 */
-	frefdiv = parent_rate / refdiv;
+/*
+ * Write the cached register image back with the pll held in bypass and
+ * reset, then release the reset.  A pll that was running is left on the
+ * lock list for the pm code to wait on with all the others.
+ * A pll whose registers survived suspend is left running as it is.  The
+ * cpu and dram plls are never reset from here, since this code and its
+ * data run off them; whatever brought the system back owns their setup.
+ */
+static void pegmatite_pll_resume(struct clk_hw *hw)
+{
+	struct pegmatite_pll *pll = to_pegmatite_pll(hw);
+	u32 mode = pll_readl(pll, fixed_mode_ssc_mode);
+	u32 rst = pll_readl(pll, rst_prediv);
+	unsigned int i;
 
-	/*
-	 * Calculate the Feedback Divider
-	 */
-	if(pll->deskew) {
-		fbdiv = (fvco / (frefdiv * vcodiv));
-	} else {
-		fbdiv = (fvco / 4) / frefdiv;
+	if (pegmatite_pll_matches_cache(pll))
+		return;
+
+	if (pll->critical) {
+		pr_warn("%s: %s does not match its saved state, leaving it alone\n",
+			__func__, __clk_get_name(hw->clk));
+		return;
 	}
 
-	/*
-	 * Calculate the output rate (w/o any Frequency Offset)
-	 */
-	if(pll->deskew) {
-		calc_rate_64 = (u64)parent_rate * fbdiv;
-		do_div(calc_rate_64, refdiv);
-	} else {
-		calc_rate_64 = (uint64_t)parent_rate * 4 * fbdiv;
-		do_div(calc_rate_64, (refdiv * vcodiv));
+	writel_relaxed(mode | (BYPASS_EN_MASK << BYPASS_EN_SHIFT), &pll->regs->fixed_mode_ssc_mode);
+	writel_relaxed(rst | (RESET_MASK << RESET_SHIFT) | (RESET_PI_MASK << RESET_PI_SHIFT) |
+		       (RESET_SSC_MASK << RESET_SSC_SHIFT), &pll->regs->rst_prediv);
+
+	for (i = 0; i < PLL_NUM_REGS; i++) {
+		if (i == offsetof(struct pll_regs, rst_prediv) / 4 ||
+		    i == offsetof(struct pll_regs, fixed_mode_ssc_mode) / 4 ||
+		    i == offsetof(struct pll_regs, lock_state) / 4)
+			continue;
+		writel_relaxed(pll->cache.vals[i], pll->cache.base + i * 4);
 	}
-	calc_rate = (unsigned int)calc_rate_64;
-
-	/*
-	 * If the calculated rate doesn't match the requested rate,
-	 * see if the calculated rate is within +/- 5% of the requested
-	 * rate.  If thats the case the pll's frequency offset
-	 * capability can make up the difference
-	 */
-	if(calc_rate != rate && !pll->deskew) {
-		s64 offset_percent;
-
-		/*
-		 * Start with our calculated rate
-		 */
-		offset_percent = (s64)(calc_rate);
-
-		/*
-		 * Subtract fvco
-		 */
-		offset_percent -= fvco;
-
-		/*
-		 * Since we can't do any floating point math in the kernel, multiply by 100000000
-		 */
-		offset_percent *= 100000000;
-
-		/*
-		 * Divide by fvco
-		 */
-		offset_percent = div_s64(offset_percent, fvco);
-
-		/*
-		 * If offset_percent is <= 5%, we can acheive the requested rate
-		 * Return the rate
-		 */
-		if(abs64(offset_percent) <= 5000000) {
-			return rate;
+
+	writel_relaxed(mode | (BYPASS_EN_MASK << BYPASS_EN_SHIFT), &pll->regs->fixed_mode_ssc_mode);
+	writel(rst, &pll->regs->rst_prediv);
+
+	if (!(mode & (BYPASS_EN_MASK << BYPASS_EN_SHIFT)) &&
+	    !(rst & (RESET_MASK << RESET_SHIFT)) &&
+	    (mode & (PU_MASK << PU_SHIFT))) {
+		if (!pll->lock_pending) {
+			pll->lock_pending = true;
+			list_add_tail(&pll->lock_node, &pll_lock_list);
 		}
 	}
-	return calc_rate;
+	else {
+		writel(mode, &pll->regs->fixed_mode_ssc_mode);
+	}
 }
 
 const struct clk_ops pegmatite_pll_ops = {
+	.prepare = pegmatite_pll_prepare,
 	.recalc_rate = pegmatite_pll_recalc_rate,
 	.set_rate = pegmatite_pll_set_rate,
 	.round_rate = pegmatite_pll_round_rate,
+	.determine_rate = pegmatite_pll_determine_rate,
 };
 
 static void __init of_pegmatite_pll_setup(struct device_node *node)
@@ -891,6 +849,23 @@ static void __init of_pegmatite_pll_setup(struct device_node *node)
 	 */
 	pll->deskew = of_property_read_bool(node, "deskew");
 
+	/*
+	 * defer-lock leaves the lock wait for the default rate to the first
+	 * prepare, for plls that nothing uses before its driver claims it
+	 */
+	pll->defer_lock = of_property_read_bool(node, "defer-lock");
+
+	/*
+	 * critical marks the plls the cpu and dram run from.  They are never
+	 * left waiting for lock, whatever defer-lock or the clock plan say.
+	 */
+	pll->critical = of_property_read_bool(node, "critical");
+	if(pll->critical && pll->defer_lock) {
+		pr_warn("%s: %s is critical, ignoring defer-lock\n", __func__, node->name);
+		pll->defer_lock = false;
+	}
+	INIT_LIST_HEAD(&pll->lock_node);
+
 	pll_base = of_iomap(node, 0);
 	if(WARN_ON(!pll_base))
 		goto free_out2;
@@ -905,18 +880,22 @@ static void __init of_pegmatite_pll_setup(struct device_node *node)
 
 	pll->hw.init = init;
 	pll->regs = pll_base;
+	pegmatite_regcache_init(&pll->cache, pll_base, PLL_NUM_REGS);
+	pegmatite_regcache_fill(&pll->cache);
 
 	clk = clk_register(NULL, &pll->hw);
 	if(WARN_ON(IS_ERR(clk)))
 		goto map_out;
 
 	of_clk_add_provider(node, of_clk_src_simple_get, clk);
+	pll->stats = pegmatite_clk_stats_register(&pll->hw);
+	pegmatite_clk_pm_register(&pll->hw, PEGMATITE_CLK_PM_PLL, NULL, pegmatite_pll_resume);
 
 	/*
-	 * If a default rate was specified in the device tree, set it here
+	 * If a default rate was specified in the device tree, hand it to the
+	 * clock plan, which sets it here unless a plan is in use
 	 */
-	if(default_rate > 0)
-		clk_set_rate(clk, default_rate);
+	pegmatite_clk_plan_add_pll(&pll->hw, default_rate);
 
 	return;
 map_out:
@@ -928,3 +907,15 @@ free_out:
 }
 
 CLK_OF_DECLARE(pegmatite_pll, "marvell,pegmatite-pll", of_pegmatite_pll_setup);
+
+/*
+ * Don't leave a defer-lock pll nobody prepared in bypass forever
+ */
+static int __init pegmatite_pll_lock_sweep(void)
+{
+	mutex_lock(&pll_lock_mutex);
+	pegmatite_pll_wait_list(true);
+	mutex_unlock(&pll_lock_mutex);
+	return 0;
+}
+late_initcall_sync(pegmatite_pll_lock_sweep);
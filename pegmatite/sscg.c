@@ -14,7 +14,16 @@
 #include <linux/of.h>
 #include <linux/io.h>
 #include <linux/delay.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/init.h>
 
+#include "clk-pegmatite.h"
 
 #define FIXED_MODE_SSC_MODE_OFFSET 0x18
 #define BYPASS_EN_MASK 0x1
@@ -37,26 +46,51 @@
 #define CSSCG_ENABLED 0x5 /* csscg_external_mux_sel and csscg_enabled */
 
 #define CSSCG_RAM(x) (0xc00 + (x * 4))
+#define CSSCG_RAM_ENTRIES (MAX_ADDR_MASK + 1)
+
+/*
+ * A spread profile is a table for CSSCG_RAM plus how it is to be used.  The
+ * sscg node itself describes the profile loaded at boot, and each child node
+ * with an sscg-table is another profile that can be selected at runtime
+ * through debugfs (pegmatite-sscg/<clock>/profile).  Switching only reloads
+ * the sscg, the pll keeps running and stays locked.
+ *
+ * The tables are generated off-line for the hardware, so profiles are
+ * picked from the ones in the device tree rather than computed here.
+ */
+struct pegmatite_sscg_profile {
+	const char		*name;
+	u32			*table;
+	unsigned int		table_len;
+	u32			mode_config;
+	unsigned int		down_spread_offset;
+};
 
 #define to_pegmatite_sscg(_hw) container_of(_hw, struct pegmatite_sscg, hw)
 struct pegmatite_sscg {
 	struct clk_hw		hw;
 	void __iomem		*base;
 	int			sscg_disabled;
-	unsigned int		down_spread_offset;
-	unsigned int		interp_points;
+	struct list_head	node;
+	struct pegmatite_sscg_profile *profiles;
+	unsigned int		num_profiles;
+	struct pegmatite_sscg_profile *cur;	/* NULL when not spreading */
 };
 
+static LIST_HEAD(sscg_list);
+static DEFINE_MUTEX(sscg_mutex);
+
 static unsigned long pegmatite_sscg_recalc_rate(struct clk_hw *hw, unsigned long parent_rate)
 {
 	struct pegmatite_sscg *sscg = to_pegmatite_sscg(hw);
+	struct pegmatite_sscg_profile *profile = sscg->cur;
 	unsigned long calc_rate;
 	int val;
 
 	/*
 	 * If sscg is disabled return the parent_rate
 	 */
-	if(sscg->sscg_disabled) {
+	if(sscg->sscg_disabled || !profile) {
 		return parent_rate;
 	}
 
@@ -72,26 +106,21 @@ static unsigned long pegmatite_sscg_recalc_rate(struct clk_hw *hw, unsigned long
 	 * If down-spread is enabled, we need to apply an offset to our reported frequency
 	 */
 	val = readl(sscg->base + CSSCG_CONTROL_OFFSET);
-	if(val == CSSCG_ENABLED && sscg->down_spread_offset != 0) {
-		unsigned long offset;
+	if(val == CSSCG_ENABLED && profile->down_spread_offset != 0) {
+		u64 offset;
 
 		/*
 		 * The down-spread-offset value read from the device tree is the offset percentage (to
-		 * three decimal places) multipled by 1000.  So we need to start by dividing the parent rate
-		 * by 100,000
+		 * three decimal places) multipled by 1000, so the spread is parent_rate * offset / 100,000.
+		 * Since we are finding the new center frequency we need half of that.  Do it in 64 bits
+		 * so the parent rate isn't rounded down to a multiple of 100,000 first.
 		 */
-		offset = parent_rate / (100000);
-
-		/*
-		 * Since we are finding the new center frequency we need to divide the offset in half, and
-		 * and then multiply it by our divided parent_rate
-		 */
-		offset = (offset * (sscg->down_spread_offset / 2));
+		offset = div_u64((u64)parent_rate * profile->down_spread_offset, 2 * 100000);
 
 		/*
 		 * Now that we have the offset, we can subtract it from the parent_rate
 		 */
-		calc_rate = parent_rate - offset;
+		calc_rate = parent_rate - (unsigned long)offset;
 	} else {
 		calc_rate = parent_rate;
 	}
@@ -99,19 +128,117 @@ static unsigned long pegmatite_sscg_recalc_rate(struct clk_hw *hw, unsigned long
 	return calc_rate;
 }
 
+/*
+ * Load a profile with the spread stopped, then restart it.  A NULL profile
+ * just stops the spread.
+ */
+static void pegmatite_sscg_load(struct pegmatite_sscg *sscg,
+				struct pegmatite_sscg_profile *profile)
+{
+	unsigned int i;
+
+	writel_relaxed(0, sscg->base + CSSCG_CONTROL_OFFSET);
+	if (!profile) {
+		wmb();
+		return;
+	}
+
+	writel_relaxed(profile->mode_config, sscg->base + CSSCG_MODE_CONFIG_OFFSET);
+	for (i = 0; i < profile->table_len; i++)
+		writel_relaxed(profile->table[i], sscg->base + CSSCG_RAM(i));
+
+	/*
+	 * Always apply correction
+	 */
+	writel(CSSCG_ENABLED, sscg->base + CSSCG_CONTROL_OFFSET);
+}
+
+/*
+ * Reload the table in one burst with the spread stopped, then restart it
+ */
+static void pegmatite_sscg_resume(struct clk_hw *hw)
+{
+	struct pegmatite_sscg *sscg = to_pegmatite_sscg(hw);
+
+	if (!sscg->sscg_disabled && sscg->cur)
+		pegmatite_sscg_load(sscg, sscg->cur);
+}
+
 const struct clk_ops pegmatite_sscg_ops = {
 	.recalc_rate = pegmatite_sscg_recalc_rate,
 };
 
+/*
+ * Read a profile (sscg-table, down-spread-offset, interp-points) from a node
+ */
+static int __init pegmatite_sscg_parse_profile(struct device_node *np,
+					       struct pegmatite_sscg_profile *profile)
+{
+	unsigned int interp_points;
+	int table_count;
+	u32 val = 0;
+
+	table_count = of_property_count_u32_elems(np, "sscg-table");
+	if (table_count <= 0)
+		return -ENOENT;
+	if (table_count > CSSCG_RAM_ENTRIES) {
+		pr_err("%s: %s: sscg-table has more than %d entries\n", __func__,
+		       np->name, CSSCG_RAM_ENTRIES);
+		return -EINVAL;
+	}
+
+	profile->table = kcalloc(table_count, sizeof(*profile->table), GFP_KERNEL);
+	if (!profile->table) {
+		pr_err("%s: could not allocate sscg table\n", __func__);
+		return -ENOMEM;
+	}
+	of_property_read_u32_array(np, "sscg-table", profile->table, table_count);
+	profile->table_len = table_count;
+
+	/*
+	 * If we are doing down-spread, then we need to know the offset percent to apply
+	 * to our reported clock frequency.  If this property is not populated, or 0, we assume
+	 * center-spread
+	 */
+	if (of_property_read_u32(np, "down-spread-offset", &profile->down_spread_offset)) {
+		profile->down_spread_offset = 0;
+	} else {
+		val |= DOWN_SPREAD_MASK << DOWN_SPREAD_SHIFT;
+	}
+
+	/*
+	 * Set the max_addr field to the number of table count minus one
+	 */
+	val |= ((table_count - 1) & MAX_ADDR_MASK) << MAX_ADDR_SHIFT;
+
+	/*
+	 * Get and set interpolation points
+	 */
+	if (of_property_read_u32(np, "interp-points", &interp_points)) {
+		interp_points = 0;
+	}
+	val |= (interp_points & INTERP_POINTS_MASK) << INTERP_POINTS_SHIFT;
+
+	/*
+	 * Always apply correction
+	 */
+	val |= APPLY_CORRECTION_MASK << APPLY_CORRECTION_SHIFT;
+	profile->mode_config = val;
+
+	return 0;
+}
+
 static void __init of_pegmatite_sscg_setup(struct device_node *node)
 {
 	struct pegmatite_sscg *sscg;
 	struct clk *clk;
 	struct clk *parent_clk;
 	struct clk_init_data *init;
+	struct device_node *child;
+	struct pegmatite_sscg_profile *profile;
 	const char *parent_name;
-	int table_count = 0, i;
-	u32 val;
+	int num_profiles;
+	bool has_default = false;
 
 	sscg = kzalloc(sizeof(*sscg), GFP_KERNEL);
 	if (!sscg) {
@@ -136,60 +263,45 @@ static void __init of_pegmatite_sscg_setup(struct device_node *node)
 		sscg->sscg_disabled = 1;
 
 	/*
-	 * If we find an sscg-table, we enable spread
+	 * The node's own table is the boot profile, the children add more
 	 */
-	table_count = of_property_count_u32_elems(node, "sscg-table");
-	if (table_count > 0 && !sscg->sscg_disabled) {
-		val = 0;
-
-		/*
-		 * If we are doing down-spread, then we need to know the offset percent to apply
-		 * to our reported clock frequency.  If this property is not populated, or 0, we assume
-		 * center-spread
-		 */
-		if (of_property_read_u32(node, "down-spread-offset", &sscg->down_spread_offset)) {
-			sscg->down_spread_offset = 0;
-		} else {
-			val |= DOWN_SPREAD_MASK << DOWN_SPREAD_SHIFT;
-		}
-
-		/*
-		 * Set the max_addr field to the number of table count minus one
-		 */
-		val |= ((table_count - 1) & MAX_ADDR_MASK) << MAX_ADDR_SHIFT;
-
-		/*
-		 * Get interpolation points
-		 */
-		if (of_property_read_u32(node, "interp-points", &sscg->interp_points)) {
-			sscg->interp_points = 0;
-		}
-
-		/*
-		 * Set interpolation points
-		 */
-		val |= (sscg->interp_points & INTERP_POINTS_MASK) << INTERP_POINTS_SHIFT;
+	num_profiles = 1 + of_get_child_count(node);
+	sscg->profiles = kcalloc(num_profiles, sizeof(*sscg->profiles), GFP_KERNEL);
+	if (!sscg->profiles) {
+		pr_err("%s: could not allocate sscg profiles\n", __func__);
+		goto map_out;
+	}
 
-		/*
-		 * Always apply correction
-		 */
-		val |= APPLY_CORRECTION_MASK << APPLY_CORRECTION_SHIFT;
-		writel(val, sscg->base + CSSCG_MODE_CONFIG_OFFSET);
+	profile = &sscg->profiles[0];
+	if (!pegmatite_sscg_parse_profile(node, profile)) {
+		profile->name = "default";
+		sscg->num_profiles++;
+		has_default = true;
+	}
 
-		for(i = 0; i < table_count; i++) {
-			of_property_read_u32_index(node, "sscg-table", i, &val);
-			writel(val, sscg->base + CSSCG_RAM(i));
-		}
+	for_each_child_of_node(node, child) {
+		profile = &sscg->profiles[sscg->num_profiles];
+		if (pegmatite_sscg_parse_profile(child, profile))
+			continue;
+		profile->name = child->name;
+		sscg->num_profiles++;
+	}
 
-		/*
-		 * Always apply correction
-		 */
-		writel(CSSCG_ENABLED, sscg->base + CSSCG_CONTROL_OFFSET);
+	/*
+	 * If we find an sscg-table, we enable spread
+	 */
+	if (has_default && !sscg->sscg_disabled) {
+		sscg->cur = &sscg->profiles[0];
+		pegmatite_sscg_load(sscg, sscg->cur);
 	}
 
 	init->name = kasprintf(GFP_KERNEL, "%s", node->name);
 	init->ops = &pegmatite_sscg_ops;
-	init->flags = 0;
+	/*
+	 * The rate changes when the profile does, without a set_rate, so let
+	 * clk_get_rate() recalculate the subtree
+	 */
+	init->flags = CLK_GET_RATE_NOCACHE;
 	parent_clk = of_clk_get(node, 0);
 	parent_name = __clk_get_name(parent_clk);
 	init->parent_names = &parent_name;
@@ -199,11 +311,20 @@ static void __init of_pegmatite_sscg_setup(struct device_node *node)
 
 	clk = clk_register(NULL, &sscg->hw);
 	if(WARN_ON(IS_ERR(clk)))
-		goto map_out;
+		goto free_profiles;
 
 	of_clk_add_provider(node, of_clk_src_simple_get, clk);
+	pegmatite_clk_pm_register(&sscg->hw, PEGMATITE_CLK_PM_SSCG, NULL, pegmatite_sscg_resume);
+
+	mutex_lock(&sscg_mutex);
+	list_add_tail(&sscg->node, &sscg_list);
+	mutex_unlock(&sscg_mutex);
 
 	return;
+free_profiles:
+	while (sscg->num_profiles--)
+		kfree(sscg->profiles[sscg->num_profiles].table);
+	kfree(sscg->profiles);
 map_out:
 	iounmap(sscg->base);
 free_out2:
@@ -213,3 +334,133 @@ free_out:
 }
 
 CLK_OF_DECLARE(pegmatite_sscg, "marvell,pegmatite-sscg", of_pegmatite_sscg_setup);
+
+/*
+ * profile lists the profiles with the current one in brackets.  Writing a
+ * profile name switches to it, "off" stops the spread.
+ */
+static int pegmatite_sscg_profile_show(struct seq_file *s, void *unused)
+{
+	struct pegmatite_sscg *sscg = s->private;
+	unsigned int i;
+
+	mutex_lock(&sscg_mutex);
+	seq_puts(s, sscg->cur ? "off" : "[off]");
+	for (i = 0; i < sscg->num_profiles; i++) {
+		if (sscg->cur == &sscg->profiles[i])
+			seq_printf(s, " [%s]", sscg->profiles[i].name);
+		else
+			seq_printf(s, " %s", sscg->profiles[i].name);
+	}
+	seq_puts(s, "\n");
+	mutex_unlock(&sscg_mutex);
+
+	return 0;
+}
+
+static int pegmatite_sscg_profile_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pegmatite_sscg_profile_show, inode->i_private);
+}
+
+static ssize_t pegmatite_sscg_profile_write(struct file *file, const char __user *ubuf,
+					    size_t count, loff_t *ppos)
+{
+	struct pegmatite_sscg *sscg = file_inode(file)->i_private;
+	struct pegmatite_sscg_profile *profile = NULL;
+	char buf[32];
+	unsigned int i;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+	strim(buf);
+
+	if (sscg->sscg_disabled)
+		return -EPERM;
+
+	if (strcmp(buf, "off")) {
+		for (i = 0; i < sscg->num_profiles; i++) {
+			if (!strcmp(buf, sscg->profiles[i].name))
+				profile = &sscg->profiles[i];
+		}
+		if (!profile)
+			return -EINVAL;
+	}
+
+	mutex_lock(&sscg_mutex);
+	if (profile != sscg->cur) {
+		sscg->cur = profile;
+		pegmatite_sscg_load(sscg, profile);
+	}
+	mutex_unlock(&sscg_mutex);
+
+	/*
+	 * Let the clock tree pick up the new mean rate
+	 */
+	clk_get_rate(sscg->hw.clk);
+
+	return count;
+}
+
+static const struct file_operations pegmatite_sscg_profile_fops = {
+	.open		= pegmatite_sscg_profile_open,
+	.read		= seq_read,
+	.write		= pegmatite_sscg_profile_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Mean output rate with the current profile next to the pll rate
+ */
+static int pegmatite_sscg_mean_rate_show(struct seq_file *s, void *unused)
+{
+	struct pegmatite_sscg *sscg = s->private;
+	unsigned long rate = clk_get_rate(sscg->hw.clk);
+	unsigned long parent_rate = clk_get_rate(__clk_get_parent(sscg->hw.clk));
+
+	seq_printf(s, "%lu Hz (pll %lu Hz, -%lu Hz)\n", rate, parent_rate,
+		   parent_rate - rate);
+
+	return 0;
+}
+
+static int pegmatite_sscg_mean_rate_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pegmatite_sscg_mean_rate_show, inode->i_private);
+}
+
+static const struct file_operations pegmatite_sscg_mean_rate_fops = {
+	.open		= pegmatite_sscg_mean_rate_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init pegmatite_sscg_debugfs_init(void)
+{
+	struct pegmatite_sscg *sscg;
+	struct dentry *root, *dir;
+
+	root = debugfs_create_dir("pegmatite-sscg", NULL);
+	if (IS_ERR_OR_NULL(root))
+		return 0;
+
+	mutex_lock(&sscg_mutex);
+	list_for_each_entry(sscg, &sscg_list, node) {
+		dir = debugfs_create_dir(__clk_get_name(sscg->hw.clk), root);
+		if (IS_ERR_OR_NULL(dir))
+			continue;
+		debugfs_create_file("profile", S_IRUGO | S_IWUSR, dir, sscg,
+				    &pegmatite_sscg_profile_fops);
+		debugfs_create_file("mean_rate", S_IRUGO, dir, sscg,
+				    &pegmatite_sscg_mean_rate_fops);
+	}
+	mutex_unlock(&sscg_mutex);
+
+	return 0;
+}
+late_initcall(pegmatite_sscg_debugfs_init);
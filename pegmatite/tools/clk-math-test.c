@@ -0,0 +1,516 @@
+/*
+ * Marvell Pegmatite SoC clock handling.
+ *
+ * Userspace harness for the rate arithmetic in clk-pegmatite-math.h.  It
+ * builds the header exactly as the drivers include it and
+ *
+ *   sweep  walks a range of requested rates through each solver and
+ *          reports how close the programmed rate gets
+ *   check  compares every solver result against a floating point model
+ *          and an exhaustive search, and checks that round_rate reports
+ *          the rate recalc_rate reads back; it fails on any mismatch
+ *   dump   prints every solver result, one per line, so a native build
+ *          can be diffed against a 32-bit one (the kernel's word size)
+ *   bench  times each solver
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2.  This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "../clk-pegmatite-math.h"
+
+/*
+ * Register field widths, as in pll.c
+ */
+#define FREQ_OFFSET_MASK	0x1ffff
+
+#define MHZ			1000000UL
+
+static const unsigned long pll_parents[] = { 25 * MHZ, 24 * MHZ, 20 * MHZ };
+static const unsigned long clkfd_parents[] = { 100 * MHZ, 200 * MHZ, 400 * MHZ };
+static const unsigned long lvdsafe_parents[] = { 297 * MHZ, 594 * MHZ, 1000 * MHZ };
+static const unsigned long oc_parents[] = { 12 * MHZ, 25 * MHZ, 27 * MHZ };
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+static unsigned int failures;
+
+#define check_fail(fmt, ...) do {				\
+	if (failures++ < 20)					\
+		fprintf(stderr, "FAIL: " fmt "\n", ##__VA_ARGS__);	\
+} while (0)
+
+/*
+ * What set_rate programs for a rate, and what recalc_rate then reads back
+ */
+struct pll_result {
+	unsigned int vcodiv;
+	unsigned int refdiv;
+	unsigned int fbdiv;
+	unsigned int calc_rate;
+	unsigned int freq_offset;
+	unsigned int recalc_rate;
+	unsigned long round_rate;
+};
+
+static void pll_solve(unsigned long rate, unsigned long parent_rate, int deskew,
+		      struct pll_result *r)
+{
+	unsigned int fvco;
+
+	/*
+	 * pegmatite_pll_set_rate
+	 */
+	r->vcodiv = pegmatite_pll_calc_vcodiv(rate, deskew);
+	fvco = rate * r->vcodiv;
+	r->refdiv = pegmatite_pll_best_refdiv(rate, parent_rate, r->vcodiv, deskew);
+	r->fbdiv = pegmatite_pll_calc_fbdiv(fvco, parent_rate / r->refdiv, r->vcodiv, deskew);
+	r->calc_rate = pegmatite_pll_calc_rate(parent_rate, r->refdiv, r->fbdiv,
+					       r->vcodiv, deskew);
+
+	r->freq_offset = pegmatite_pll_rate_offset(r->calc_rate, rate, deskew) &
+			 FREQ_OFFSET_MASK;
+
+	/*
+	 * pegmatite_pll_recalc_rate, from the register values
+	 */
+	r->recalc_rate = pegmatite_pll_calc_rate(parent_rate, r->refdiv, r->fbdiv,
+						 r->vcodiv, deskew);
+	if (!deskew)
+		r->recalc_rate = pegmatite_pll_apply_freq_offset(r->recalc_rate,
+								 r->freq_offset);
+
+	/*
+	 * pegmatite_pll_round_rate
+	 */
+	r->round_rate = pegmatite_pll_calc_round_rate(rate, parent_rate, deskew);
+}
+
+/*
+ * The offset is only 16 bits, so a rate it makes up can be off by one step
+ * of calc_rate / 2^20 (and a Hz of rounding).  Anything further apart
+ * means round_rate promised a rate set_rate doesn't program.
+ */
+static double pll_offset_step(const struct pll_result *r)
+{
+	return r->calc_rate / 1048576.0 + 1.0;
+}
+
+static int pll_round_disagrees(const struct pll_result *r)
+{
+	return fabs((double)r->round_rate - (double)r->recalc_rate) > pll_offset_step(r);
+}
+
+/*
+ * Requested rates for each solver.  Each walk calls fn for every rate.
+ */
+static void pll_walk_mode(void (*fn)(unsigned long rate, unsigned long parent, int deskew),
+			  int deskew)
+{
+	unsigned long rate;
+	unsigned int p;
+
+	for (p = 0; p < ARRAY_SIZE(pll_parents); p++) {
+		if (deskew)
+			for (rate = 25 * MHZ; rate <= 750 * MHZ; rate += 250000)
+				fn(rate, pll_parents[p], 1);
+		else
+			for (rate = 100 * MHZ; rate <= 2000 * MHZ; rate += 250000)
+				fn(rate, pll_parents[p], 0);
+	}
+}
+
+static void pll_walk(void (*fn)(unsigned long rate, unsigned long parent, int deskew))
+{
+	pll_walk_mode(fn, 0);
+	pll_walk_mode(fn, 1);
+}
+
+static void clkfd_walk(void (*fn)(unsigned long rate, unsigned long parent))
+{
+	unsigned long rate;
+	unsigned int p;
+
+	for (p = 0; p < ARRAY_SIZE(clkfd_parents); p++)
+		for (rate = clkfd_parents[p] / PEGMATITE_CLKFD_MAX; rate < clkfd_parents[p] / 2;
+		     rate += rate / 64 + 1)
+			fn(rate, clkfd_parents[p]);
+}
+
+static void lvdsafe_walk(void (*fn)(unsigned long rate, unsigned long parent))
+{
+	unsigned long rate;
+	unsigned int p;
+
+	for (p = 0; p < ARRAY_SIZE(lvdsafe_parents); p++)
+		for (rate = lvdsafe_parents[p] / PEGMATITE_LVDSAFE_MAX_DIV;
+		     rate <= lvdsafe_parents[p] / PEGMATITE_LVDSAFE_MIN_DIV; rate += rate / 256 + 1)
+			fn(rate, lvdsafe_parents[p]);
+}
+
+static void oc_walk(void (*fn)(unsigned long rate, unsigned long parent))
+{
+	unsigned long rate;
+	unsigned int p;
+
+	for (p = 0; p < ARRAY_SIZE(oc_parents); p++)
+		for (rate = oc_parents[p]; rate <= 500 * MHZ; rate += rate / 512 + 1)
+			fn(rate, oc_parents[p]);
+}
+
+/*
+ * sweep
+ */
+static struct {
+	unsigned long points;
+	unsigned long exact;
+	unsigned long round_mismatch;	/* round_rate != what recalc reads back */
+	double max_ppm;
+	unsigned long max_ppm_rate;
+	unsigned long max_ppm_parent;
+} sweep_stats;
+
+static void sweep_account(unsigned long rate, unsigned long parent, unsigned long got)
+{
+	double ppm = fabs((double)got - (double)rate) * 1e6 / (double)rate;
+
+	sweep_stats.points++;
+	if (got == rate)
+		sweep_stats.exact++;
+	if (ppm > sweep_stats.max_ppm) {
+		sweep_stats.max_ppm = ppm;
+		sweep_stats.max_ppm_rate = rate;
+		sweep_stats.max_ppm_parent = parent;
+	}
+}
+
+static void sweep_report(const char *name)
+{
+	printf("%-11s %7lu rates, %8lu exact, worst %10.1f ppm (%lu Hz from %lu Hz)",
+	       name, sweep_stats.points, sweep_stats.exact, sweep_stats.max_ppm,
+	       sweep_stats.max_ppm_rate, sweep_stats.max_ppm_parent);
+	if (sweep_stats.round_mismatch)
+		printf(", round_rate disagrees with recalc for %lu",
+		       sweep_stats.round_mismatch);
+	printf("\n");
+	memset(&sweep_stats, 0, sizeof(sweep_stats));
+}
+
+static void sweep_pll(unsigned long rate, unsigned long parent, int deskew)
+{
+	struct pll_result r;
+
+	pll_solve(rate, parent, deskew, &r);
+	sweep_account(rate, parent, r.recalc_rate);
+	if (pll_round_disagrees(&r))
+		sweep_stats.round_mismatch++;
+}
+
+static void sweep_clkfd(unsigned long rate, unsigned long parent)
+{
+	unsigned int num, denom;
+
+	sweep_account(rate, parent, pegmatite_clkfd_calc(rate, parent, &num, &denom));
+}
+
+static void sweep_lvdsafe(unsigned long rate, unsigned long parent)
+{
+	sweep_account(rate, parent, parent / pegmatite_clklvdsafe_calc_div(rate, parent));
+}
+
+static void sweep_oc(unsigned long rate, unsigned long parent)
+{
+	sweep_account(rate, parent, parent * pegmatite_oc_factor_calc_mult(rate, parent));
+}
+
+static void do_sweep(void)
+{
+	pll_walk_mode(sweep_pll, 0);
+	sweep_report("pll");
+	pll_walk_mode(sweep_pll, 1);
+	sweep_report("pll-deskew");
+	clkfd_walk(sweep_clkfd);
+	sweep_report("clkfd");
+	lvdsafe_walk(sweep_lvdsafe);
+	sweep_report("lvdsafe");
+	oc_walk(sweep_oc);
+	sweep_report("oc-factor");
+}
+
+/*
+ * check
+ */
+static void check_pll(unsigned long rate, unsigned long parent, int deskew)
+{
+	struct pll_result r;
+	double calc, p, off, want;
+	long long code;
+	int offset;
+
+	pll_solve(rate, parent, deskew, &r);
+
+	/*
+	 * Integer output rate of the programmed dividers.  In deskew mode
+	 * the feedback is taken after the post divider.
+	 */
+	if (deskew)
+		calc = (double)parent * r.fbdiv / r.refdiv;
+	else
+		calc = (double)parent * 4 * r.fbdiv / ((double)r.refdiv * r.vcodiv);
+	if (fabs(calc - r.calc_rate) >= 1.0)
+		check_fail("pll %lu from %lu: calc_rate %u, model %.1f",
+			   rate, parent, r.calc_rate, calc);
+
+	/*
+	 * The offset is relative to the requested output rate,
+	 * p = (calc_rate - rate) / rate, and only covers +/- 5%.
+	 * freq_offset[15:0] = 2^20 * |p| / (1 + p), bit 16 set when p <= 0.
+	 */
+	p = (calc - (double)rate) / (double)rate;
+	offset = !deskew && r.calc_rate != rate && fabs(p) <= 0.05;
+	if (offset != !!r.freq_offset) {
+		check_fail("pll %lu from %lu: freq_offset 0x%x for %+.4f%%",
+			   rate, parent, r.freq_offset, p * 100.0);
+		return;
+	}
+
+	want = calc;
+	if (offset) {
+		off = 1048576.0 * fabs(p) / (1.0 + p);
+		code = (long long)off | (p <= 0 ? 0x10000 : 0);
+		if (llabs(code - (long long)r.freq_offset) > 1)
+			check_fail("pll %lu from %lu: freq_offset 0x%x, model 0x%llx",
+				   rate, parent, r.freq_offset, code);
+
+		/*
+		 * Which moves the output by calc_rate * freq_offset[15:0] / 2^20
+		 */
+		off = calc * (r.freq_offset & 0xffff) / 1048576.0;
+		want = (r.freq_offset & 0x10000) ? calc + off : calc - off;
+		if (fabs(want - (double)rate) > pll_offset_step(&r))
+			check_fail("pll %lu from %lu: offset lands on %.1f", rate, parent, want);
+	}
+	if (fabs(want - r.recalc_rate) > 2.0)
+		check_fail("pll %lu from %lu: recalc_rate %u, model %.1f",
+			   rate, parent, r.recalc_rate, want);
+
+	if (pll_round_disagrees(&r))
+		check_fail("pll %lu from %lu: round_rate %lu, recalc_rate %u",
+			   rate, parent, r.round_rate, r.recalc_rate);
+}
+
+static double clkfd_excess_ppm;
+
+static void check_clkfd(unsigned long rate, unsigned long parent)
+{
+	unsigned int num, denom, n;
+	unsigned long got;
+	double err, best = INFINITY, d;
+
+	got = pegmatite_clkfd_calc(rate, parent, &num, &denom);
+	if (num > PEGMATITE_CLKFD_MAX || denom > PEGMATITE_CLKFD_MAX || !num || !denom)
+		check_fail("clkfd %lu from %lu: %u/%u out of range", rate, parent, denom, num);
+	if (fabs((double)parent * denom / (2.0 * num) - got) >= 1.0)
+		check_fail("clkfd %lu from %lu: reports %lu for %u/%u", rate, parent, got,
+			   denom, num);
+
+	/*
+	 * How much worse than the best 16 bit pair is the solver?
+	 */
+	for (n = 1; n <= PEGMATITE_CLKFD_MAX; n++) {
+		d = floor(2.0 * rate * n / parent + 0.5);
+		if (d < 1 || d > PEGMATITE_CLKFD_MAX)
+			continue;
+		err = fabs((double)parent * d / (2.0 * n) - rate);
+		if (err < best)
+			best = err;
+	}
+	err = fabs((double)got - rate);
+	if (best != INFINITY && (err - best) * 1e6 / rate > clkfd_excess_ppm)
+		clkfd_excess_ppm = (err - best) * 1e6 / rate;
+}
+
+static void check_lvdsafe(unsigned long rate, unsigned long parent)
+{
+	unsigned int div = pegmatite_clklvdsafe_calc_div(rate, parent);
+	unsigned int d;
+	long long err, best;
+
+	if (div < PEGMATITE_LVDSAFE_MIN_DIV || div > PEGMATITE_LVDSAFE_MAX_DIV)
+		check_fail("lvdsafe %lu from %lu: divider %u out of range", rate, parent, div);
+
+	err = llabs((long long)rate - (long long)(parent / div));
+	for (d = PEGMATITE_LVDSAFE_MIN_DIV; d <= PEGMATITE_LVDSAFE_MAX_DIV; d++) {
+		best = llabs((long long)rate - (long long)(parent / d));
+		if (best < err) {
+			check_fail("lvdsafe %lu from %lu: divider %u, %u is closer",
+				   rate, parent, div, d);
+			break;
+		}
+	}
+}
+
+static void check_oc(unsigned long rate, unsigned long parent)
+{
+	unsigned int mult = pegmatite_oc_factor_calc_mult(rate, parent);
+	unsigned int m;
+	long long err, best;
+
+	if (!mult)
+		check_fail("oc-factor %lu from %lu: multiplier 0", rate, parent);
+
+	err = llabs((long long)rate - (long long)parent * mult);
+	for (m = 1; m <= mult + 1; m++) {
+		best = llabs((long long)rate - (long long)parent * m);
+		if (best < err) {
+			check_fail("oc-factor %lu from %lu: multiplier %u, %u is closer",
+				   rate, parent, mult, m);
+			break;
+		}
+	}
+}
+
+static int do_check(void)
+{
+	pll_walk(check_pll);
+	clkfd_walk(check_clkfd);
+	lvdsafe_walk(check_lvdsafe);
+	oc_walk(check_oc);
+
+	printf("clkfd: at most %.3f ppm worse than an exhaustive search\n", clkfd_excess_ppm);
+	if (failures) {
+		printf("%u checks failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
+
+/*
+ * dump
+ */
+static void dump_pll(unsigned long rate, unsigned long parent, int deskew)
+{
+	struct pll_result r;
+
+	pll_solve(rate, parent, deskew, &r);
+	printf("pll %lu %lu %d: %u %u %u %u 0x%05x %u %lu\n", rate, parent, deskew,
+	       r.vcodiv, r.refdiv, r.fbdiv, r.calc_rate, r.freq_offset, r.recalc_rate,
+	       r.round_rate);
+}
+
+static void dump_clkfd(unsigned long rate, unsigned long parent)
+{
+	unsigned int num, denom;
+	unsigned long got = pegmatite_clkfd_calc(rate, parent, &num, &denom);
+
+	printf("clkfd %lu %lu: %u %u %lu\n", rate, parent, denom, num, got);
+}
+
+static void dump_lvdsafe(unsigned long rate, unsigned long parent)
+{
+	printf("lvdsafe %lu %lu: %u\n", rate, parent,
+	       pegmatite_clklvdsafe_calc_div(rate, parent));
+}
+
+static void dump_oc(unsigned long rate, unsigned long parent)
+{
+	printf("oc-factor %lu %lu: %u\n", rate, parent,
+	       pegmatite_oc_factor_calc_mult(rate, parent));
+}
+
+static void do_dump(void)
+{
+	pll_walk(dump_pll);
+	clkfd_walk(dump_clkfd);
+	lvdsafe_walk(dump_lvdsafe);
+	oc_walk(dump_oc);
+}
+
+/*
+ * bench
+ */
+static volatile unsigned long bench_sink;
+static unsigned long bench_calls;
+
+static void bench_pll(unsigned long rate, unsigned long parent, int deskew)
+{
+	bench_sink += pegmatite_pll_calc_round_rate(rate, parent, deskew);
+	bench_calls++;
+}
+
+static void bench_clkfd(unsigned long rate, unsigned long parent)
+{
+	unsigned int num, denom;
+
+	bench_sink += pegmatite_clkfd_calc(rate, parent, &num, &denom);
+	bench_calls++;
+}
+
+static void bench_lvdsafe(unsigned long rate, unsigned long parent)
+{
+	bench_sink += pegmatite_clklvdsafe_calc_div(rate, parent);
+	bench_calls++;
+}
+
+static void bench_oc(unsigned long rate, unsigned long parent)
+{
+	bench_sink += pegmatite_oc_factor_calc_mult(rate, parent);
+	bench_calls++;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#define BENCH_ROUNDS	20
+
+#define bench(name, walk, fn) do {					\
+	double start;							\
+	int i;								\
+									\
+	bench_calls = 0;						\
+	start = now_ns();						\
+	for (i = 0; i < BENCH_ROUNDS; i++)				\
+		walk(fn);						\
+	printf("%-11s %9lu calls, %8.1f ns/call\n", name, bench_calls,	\
+	       (now_ns() - start) / bench_calls);			\
+} while (0)
+
+static void do_bench(void)
+{
+	bench("pll", pll_walk, bench_pll);
+	bench("clkfd", clkfd_walk, bench_clkfd);
+	bench("lvdsafe", lvdsafe_walk, bench_lvdsafe);
+	bench("oc-factor", oc_walk, bench_oc);
+}
+
+int main(int argc, char **argv)
+{
+	const char *cmd = argc > 1 ? argv[1] : "check";
+
+	if (!strcmp(cmd, "sweep"))
+		do_sweep();
+	else if (!strcmp(cmd, "check"))
+		return do_check();
+	else if (!strcmp(cmd, "dump"))
+		do_dump();
+	else if (!strcmp(cmd, "bench"))
+		do_bench();
+	else {
+		fprintf(stderr, "usage: %s [sweep|check|dump|bench]\n", argv[0]);
+		return 2;
+	}
+
+	return 0;
+}
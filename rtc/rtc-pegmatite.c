@@ -16,6 +16,15 @@
 #include <linux/delay.h>
 #include <linux/gfp.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/pm.h>
+#include <linux/workqueue.h>
+#include <linux/of_address.h>
+#include <linux/clocksource.h>
+#include <linux/time.h>
+#include <asm/mach/time.h>
 
 #define RTC_STATUS 0x0
 #define RTC_INT1   0x4
@@ -39,37 +48,169 @@
  * Because of the wicked slow bus speed the spec suggests waiting 5us between register operations,
  * but it seems like we really need 10us
  */
-#define writel_delay(x,y)	({ writel(x,y); udelay(10); })
-#define readl_delay(x)		({ u32 __v = readl(x); udelay(10); __v; })
+#define RTC_ACCESS_NS	(10 * NSEC_PER_USEC)
+
+/*
+ * Time reads are answered from a (RTC seconds, monotonic time) pair latched
+ * from the hardware, and the hardware is only read again once the last read
+ * is older than this.  0 reads the hardware every time.
+ */
+static unsigned int rtc_cache_ms = 10000;
+module_param(rtc_cache_ms, uint, 0644);
+MODULE_PARM_DESC(rtc_cache_ms, "How long (ms) to answer time reads without reading the RTC, 0 to always read it");
 
 struct pegmatite_rtc_data {
+	struct platform_device *pdev;
 	struct rtc_device *rtc;
 	void __iomem *ioaddr;
 	int		irq;
+	/* Time of the last register access, under access_lock */
+	spinlock_t	access_lock;
+	ktime_t		last_access;
+	/*
+	 * Latched time, serialised by the rtc core's ops_lock.  The second
+	 * cache_seconds started somewhere in (cache_lo_ns, cache_hi_ns] of
+	 * monotonic time, so the pair is only as accurate as that window.
+	 */
+	bool		cache_valid;
+	unsigned long	cache_seconds;
+	s64		cache_lo_ns;
+	s64		cache_hi_ns;
+	s64		cache_read_ns;	/* last read of the counter */
+	struct work_struct reset_work;
 };
 
+/*
+ * Every register access has to be RTC_ACCESS_NS after the one before.
+ * Rather than waiting after each access, wait before one only for what is
+ * left of that interval, usually nothing.  The wait is a sleep unless the
+ * caller is atomic.
+ */
+static u32 pegmatite_rtc_access(struct pegmatite_rtc_data *pdata, int off,
+				u32 val, bool write, bool atomic)
+{
+	unsigned long flags;
+	s64 wait_ns;
+
+	for (;;) {
+		spin_lock_irqsave(&pdata->access_lock, flags);
+		wait_ns = RTC_ACCESS_NS -
+			  ktime_to_ns(ktime_sub(ktime_get(), pdata->last_access));
+		if (wait_ns <= 0)
+			break;
+		spin_unlock_irqrestore(&pdata->access_lock, flags);
+
+		if (atomic)
+			udelay(DIV_ROUND_UP((u32)wait_ns, NSEC_PER_USEC));
+		else
+			usleep_range(DIV_ROUND_UP((u32)wait_ns, NSEC_PER_USEC),
+				     RTC_ACCESS_NS / NSEC_PER_USEC * 2);
+	}
+
+	if (write)
+		writel(val, pdata->ioaddr + off);
+	else
+		val = readl(pdata->ioaddr + off);
+
+	pdata->last_access = ktime_get();
+	spin_unlock_irqrestore(&pdata->access_lock, flags);
+
+	return val;
+}
+
+static u32 pegmatite_rtc_readl(struct pegmatite_rtc_data *pdata, int off)
+{
+	return pegmatite_rtc_access(pdata, off, 0, false, false);
+}
+
+static void pegmatite_rtc_writel(struct pegmatite_rtc_data *pdata, u32 val, int off)
+{
+	pegmatite_rtc_access(pdata, off, val, true, false);
+}
+
+static void pegmatite_rtc_writel_atomic(struct pegmatite_rtc_data *pdata, u32 val, int off)
+{
+	pegmatite_rtc_access(pdata, off, val, true, true);
+}
+
 static int pegmatite_rtc_set_time(struct device *dev, struct rtc_time *tm)
 {
 	struct pegmatite_rtc_data *pdata = dev_get_drvdata(dev);
-	void __iomem *ioaddr = pdata->ioaddr;
 	unsigned long seconds = 0;
 
 	/* convert to seconds */
 	rtc_tm_to_time(tm, &seconds);
 
 	/* spec says you need to write twice */
-	writel_delay(seconds, ioaddr + RTC_TIME);
-	writel_delay(seconds, ioaddr + RTC_TIME);
+	pegmatite_rtc_writel(pdata, seconds, RTC_TIME);
+	pegmatite_rtc_writel(pdata, seconds, RTC_TIME);
+
+	pdata->cache_valid = false;
 	return 0;
 }
 
+/*
+ * The counter only gives whole seconds, so one read only says the current
+ * second started within the last second.  Rather than wait for the counter
+ * to tick over, every read narrows the window in which the latched second
+ * started: reading seconds between before_ns and after_ns means it had
+ * started by after_ns, and the one after it hadn't by before_ns.  A read
+ * that doesn't fit the window (after set_time or resume, or once the RTC
+ * crystal has drifted against the monotonic clock) latches a new pair,
+ * accurate to within a second.
+ */
+static unsigned long pegmatite_rtc_read_seconds(struct pegmatite_rtc_data *pdata)
+{
+	unsigned long seconds;
+	s64 before_ns, after_ns, offset_ns, lo_ns, hi_ns;
+
+	before_ns = ktime_to_ns(ktime_get());
+	seconds = pegmatite_rtc_readl(pdata, RTC_TIME);
+	after_ns = ktime_to_ns(ktime_get());
+
+	if (pdata->cache_valid) {
+		offset_ns = (s64)(long)(seconds - pdata->cache_seconds) * NSEC_PER_SEC;
+		lo_ns = max_t(s64, pdata->cache_lo_ns, before_ns - offset_ns - NSEC_PER_SEC);
+		hi_ns = min_t(s64, pdata->cache_hi_ns, after_ns - offset_ns);
+		if (lo_ns < hi_ns) {
+			pdata->cache_lo_ns = lo_ns;
+			pdata->cache_hi_ns = hi_ns;
+			goto out;
+		}
+	}
+
+	pdata->cache_seconds = seconds;
+	pdata->cache_lo_ns = before_ns - NSEC_PER_SEC;
+	pdata->cache_hi_ns = after_ns;
+	pdata->cache_valid = true;
+out:
+	pdata->cache_read_ns = after_ns;
+	return seconds;
+}
+
+/*
+ * Within rtc_cache_ms of the last read the time is predicted from the pair,
+ * taking the latest point the second can have started so the prediction is
+ * never ahead of the counter.  After that the counter is read again.
+ */
+static unsigned long pegmatite_rtc_get_seconds(struct pegmatite_rtc_data *pdata)
+{
+	s64 now_ns = ktime_to_ns(ktime_get());
+
+	if (pdata->cache_valid &&
+	    now_ns - pdata->cache_read_ns < (s64)rtc_cache_ms * NSEC_PER_MSEC)
+		return pdata->cache_seconds +
+		       (unsigned long)div_s64(now_ns - pdata->cache_hi_ns, NSEC_PER_SEC);
+
+	return pegmatite_rtc_read_seconds(pdata);
+}
+
 static int pegmatite_rtc_read_time(struct device *dev, struct rtc_time *tm)
 {
 	struct pegmatite_rtc_data *pdata = dev_get_drvdata(dev);
-	void __iomem *ioaddr = pdata->ioaddr;
 	unsigned long seconds;
 
-	seconds = readl_delay(ioaddr + RTC_TIME);
+	seconds = pegmatite_rtc_get_seconds(pdata);
 
 	/* convert to rtc_time */
 	rtc_time_to_tm(seconds, tm);
@@ -80,10 +221,9 @@ static int pegmatite_rtc_read_time(struct device *dev, struct rtc_time *tm)
 static int pegmatite_rtc_read_alarm(struct device *dev, struct rtc_wkalrm *alm)
 {
 	struct pegmatite_rtc_data *pdata = dev_get_drvdata(dev);
-	void __iomem *ioaddr = pdata->ioaddr;
 	unsigned long seconds;
 
-	seconds = readl_delay(ioaddr + RTC_ALRM1);
+	seconds = pegmatite_rtc_readl(pdata, RTC_ALRM1);
 
 	/* convert to rtc_time */
 	rtc_time_to_tm(seconds, &alm->time);
@@ -93,7 +233,7 @@ static int pegmatite_rtc_read_alarm(struct device *dev, struct rtc_wkalrm *alm)
 		rtc_time_to_tm(0, &alm->time);
 	}
 
-	alm->enabled = !!(RTC_INT1_ENABLED & readl_delay(ioaddr + RTC_INT1));
+	alm->enabled = !!(RTC_INT1_ENABLED & pegmatite_rtc_readl(pdata, RTC_INT1));
 
 	return 0;
 }
@@ -101,14 +241,13 @@ static int pegmatite_rtc_read_alarm(struct device *dev, struct rtc_wkalrm *alm)
 static int pegmatite_rtc_set_alarm(struct device *dev, struct rtc_wkalrm *alm)
 {
 	struct pegmatite_rtc_data *pdata = dev_get_drvdata(dev);
-	void __iomem *ioaddr = pdata->ioaddr;
 	unsigned long seconds = 0;
 
 	/* convert to seconds */
 	rtc_tm_to_time(&alm->time, &seconds);
 
-	writel_delay(seconds, ioaddr + RTC_ALRM1);
-	writel_delay(alm->enabled ? RTC_INT1_ENABLED : RTC_INT1_DISABLED, ioaddr + RTC_INT1);
+	pegmatite_rtc_writel(pdata, seconds, RTC_ALRM1);
+	pegmatite_rtc_writel(pdata, alm->enabled ? RTC_INT1_ENABLED : RTC_INT1_DISABLED, RTC_INT1);
 
 	return 0;
 }
@@ -117,15 +256,14 @@ static int pegmatite_rtc_alarm_irq_enable(struct device *dev, unsigned int enabl
 {
 	struct platform_device *pdev = to_platform_device(dev);
 	struct pegmatite_rtc_data *pdata = platform_get_drvdata(pdev);
-	void __iomem *ioaddr = pdata->ioaddr;
 
 	if (pdata->irq < 0)
 		return -EINVAL; /* fall back into rtc-dev's emulation */
 
 	if (enabled)
-		writel_delay(RTC_INT1_ENABLED, ioaddr + RTC_INT1);
+		pegmatite_rtc_writel(pdata, RTC_INT1_ENABLED, RTC_INT1);
 	else
-		writel_delay(RTC_INT1_DISABLED, ioaddr + RTC_INT1);
+		pegmatite_rtc_writel(pdata, RTC_INT1_DISABLED, RTC_INT1);
 
 	return 0;
 }
@@ -133,10 +271,9 @@ static int pegmatite_rtc_alarm_irq_enable(struct device *dev, unsigned int enabl
 static irqreturn_t pegmatite_rtc_interrupt(int irq, void *data)
 {
 	struct pegmatite_rtc_data *pdata = data;
-	void __iomem *ioaddr = pdata->ioaddr;
 
 	/* clear interrupt */
-	writel_delay(RTC_ALRM1_MASK, ioaddr + RTC_STATUS);
+	pegmatite_rtc_writel_atomic(pdata, RTC_ALRM1_MASK, RTC_STATUS);
 
 	rtc_update_irq(pdata->rtc, 1, RTC_IRQF | RTC_AF);
 	return IRQ_HANDLED;
@@ -155,43 +292,9 @@ static const struct rtc_class_ops pegmatite_rtc_alarm_ops = {
 	.alarm_irq_enable = pegmatite_rtc_alarm_irq_enable,
 };
 
-static int __init pegmatite_rtc_probe(struct platform_device *pdev)
+static int pegmatite_rtc_register(struct platform_device *pdev)
 {
-	struct resource *res;
-	struct pegmatite_rtc_data *pdata;
-	u32 test_config;
-
-	pdata = devm_kzalloc(&pdev->dev, sizeof(*pdata), GFP_KERNEL);
-	if (!pdata)
-		return -ENOMEM;
-
-	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-	pdata->ioaddr = devm_ioremap_resource(&pdev->dev, res);
-	if (IS_ERR(pdata->ioaddr))
-		return PTR_ERR(pdata->ioaddr);
-
-	test_config = readl_delay(pdata->ioaddr + RTC_TEST);
-        if(test_config != 0) {
-		dev_err(&pdev->dev, "Initial power-up, running reset procedure\n");
-		writel_delay(0, pdata->ioaddr + RTC_TEST);
-		mdelay(500);
-		writel_delay(0, pdata->ioaddr + RTC_TIME);
-		udelay(62);
-		writel_delay(3, pdata->ioaddr + RTC_STATUS);
-		udelay(62);
-		writel_delay(0, pdata->ioaddr + RTC_INT1);
-		writel_delay(0, pdata->ioaddr + RTC_INT2);
-		writel_delay(0, pdata->ioaddr + RTC_ALRM1);
-		writel_delay(0, pdata->ioaddr + RTC_ALRM2);
-		writel_delay(0, pdata->ioaddr + RTC_CC);
-		writel_delay(0, pdata->ioaddr + RTC_TIME);
-		writel_delay(3, pdata->ioaddr + RTC_STATUS);
-		udelay(62);
-        }
-
-	pdata->irq = platform_get_irq(pdev, 0);
-
-	platform_set_drvdata(pdev, pdata);
+	struct pegmatite_rtc_data *pdata = platform_get_drvdata(pdev);
 
 	if (pdata->irq >= 0) {
 		device_init_wakeup(&pdev->dev, 1);
@@ -208,8 +311,8 @@ static int __init pegmatite_rtc_probe(struct platform_device *pdev)
 	}
 
 	if (pdata->irq >= 0) {
-		writel_delay(RTC_INT1_DISABLED, pdata->ioaddr + RTC_INT1);
-		writel_delay(RTC_INT2_DISABLED, pdata->ioaddr + RTC_INT2);
+		pegmatite_rtc_writel(pdata, RTC_INT1_DISABLED, RTC_INT1);
+		pegmatite_rtc_writel(pdata, RTC_INT2_DISABLED, RTC_INT2);
 		if (devm_request_irq(&pdev->dev, pdata->irq, pegmatite_rtc_interrupt,
 				     IRQF_SHARED,
 				     pdev->name, pdata) < 0) {
@@ -221,16 +324,138 @@ static int __init pegmatite_rtc_probe(struct platform_device *pdev)
 	return 0;
 }
 
+/*
+ * The power-up reset takes over half a second, so it runs here rather than
+ * in probe, and the rtc is registered once it is done
+ */
+static void pegmatite_rtc_reset_work(struct work_struct *work)
+{
+	struct pegmatite_rtc_data *pdata =
+		container_of(work, struct pegmatite_rtc_data, reset_work);
+	int ret;
+
+	pegmatite_rtc_writel(pdata, 0, RTC_TEST);
+	msleep(500);
+	pegmatite_rtc_writel(pdata, 0, RTC_TIME);
+	usleep_range(62, 100);
+	pegmatite_rtc_writel(pdata, 3, RTC_STATUS);
+	usleep_range(62, 100);
+	pegmatite_rtc_writel(pdata, 0, RTC_INT1);
+	pegmatite_rtc_writel(pdata, 0, RTC_INT2);
+	pegmatite_rtc_writel(pdata, 0, RTC_ALRM1);
+	pegmatite_rtc_writel(pdata, 0, RTC_ALRM2);
+	pegmatite_rtc_writel(pdata, 0, RTC_CC);
+	pegmatite_rtc_writel(pdata, 0, RTC_TIME);
+	pegmatite_rtc_writel(pdata, 3, RTC_STATUS);
+	usleep_range(62, 100);
+
+	ret = pegmatite_rtc_register(pdata->pdev);
+	if (ret)
+		dev_err(&pdata->pdev->dev, "failed to register rtc: %d\n", ret);
+}
+
+static int __init pegmatite_rtc_probe(struct platform_device *pdev)
+{
+	struct resource *res;
+	struct pegmatite_rtc_data *pdata;
+	u32 test_config;
+
+	pdata = devm_kzalloc(&pdev->dev, sizeof(*pdata), GFP_KERNEL);
+	if (!pdata)
+		return -ENOMEM;
+
+	pdata->pdev = pdev;
+	spin_lock_init(&pdata->access_lock);
+	INIT_WORK(&pdata->reset_work, pegmatite_rtc_reset_work);
+
+	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+	pdata->ioaddr = devm_ioremap_resource(&pdev->dev, res);
+	if (IS_ERR(pdata->ioaddr))
+		return PTR_ERR(pdata->ioaddr);
+
+	pdata->irq = platform_get_irq(pdev, 0);
+
+	platform_set_drvdata(pdev, pdata);
+
+	test_config = pegmatite_rtc_readl(pdata, RTC_TEST);
+        if(test_config != 0) {
+		dev_err(&pdev->dev, "Initial power-up, running reset procedure\n");
+		schedule_work(&pdata->reset_work);
+		return 0;
+        }
+
+	return pegmatite_rtc_register(pdev);
+}
+
+#ifdef CONFIG_PM_SLEEP
+/*
+ * The monotonic clock doesn't count time spent suspended
+ */
+static int pegmatite_rtc_resume(struct device *dev)
+{
+	struct pegmatite_rtc_data *pdata = dev_get_drvdata(dev);
+
+	pdata->cache_valid = false;
+	return 0;
+}
+#endif
+
+static SIMPLE_DEV_PM_OPS(pegmatite_rtc_pm_ops, NULL, pegmatite_rtc_resume);
+
 static int __exit pegmatite_rtc_remove(struct platform_device *pdev)
 {
 	struct pegmatite_rtc_data *pdata = platform_get_drvdata(pdev);
 
+	cancel_work_sync(&pdata->reset_work);
+
 	if (pdata->irq >= 0)
 		device_init_wakeup(&pdev->dev, 0);
 
 	return 0;
 }
 
+#ifndef MODULE
+/*
+ * The seconds counter doubles as the persistent clock, mapped early from
+ * the same node so timekeeping starts with the right time instead of
+ * waiting for the rtc class device and hctosys.  Skipped on a fresh unit,
+ * whose counter means nothing until the driver has run the reset.
+ */
+static void __iomem *pegmatite_rtc_early_base;
+
+static void pegmatite_rtc_read_persistent_clock(struct timespec *ts)
+{
+	ts->tv_sec = readl(pegmatite_rtc_early_base + RTC_TIME);
+	ts->tv_nsec = 0;
+}
+
+static void __init pegmatite_rtc_early_init(struct device_node *np)
+{
+	struct timespec ts;
+	u32 test_config;
+
+	pegmatite_rtc_early_base = of_iomap(np, 0);
+	if (!pegmatite_rtc_early_base) {
+		pr_err("%s: could not map rtc\n", __func__);
+		return;
+	}
+
+	test_config = readl(pegmatite_rtc_early_base + RTC_TEST);
+	udelay(RTC_ACCESS_NS / NSEC_PER_USEC);
+	if (test_config != 0) {
+		iounmap(pegmatite_rtc_early_base);
+		pegmatite_rtc_early_base = NULL;
+		return;
+	}
+
+	register_persistent_clock(NULL, pegmatite_rtc_read_persistent_clock);
+
+	pegmatite_rtc_read_persistent_clock(&ts);
+	do_settimeofday(&ts);
+}
+CLOCKSOURCE_OF_DECLARE(pegmatite_rtc, "marvell,pegmatite-rtc", pegmatite_rtc_early_init);
+#endif
+
 #ifdef CONFIG_OF
 static const struct of_device_id rtc_pegmatite_of_match_table[] = {
 	{ .compatible = "marvell,pegmatite-rtc", },
@@ -244,6 +469,7 @@ static struct platform_driver pegmatite_rtc_driver = {
 	.driver		= {
 		.name	= "rtc-pegmatite",
 		.owner	= THIS_MODULE,
+		.pm	= &pegmatite_rtc_pm_ops,
 		.of_match_table = of_match_ptr(rtc_pegmatite_of_match_table),
 	},
 };
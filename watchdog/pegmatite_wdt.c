@@ -17,6 +17,7 @@
 #include <linux/init.h>
 #include <linux/io.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
 #include <linux/err.h>
 #include <linux/of.h>
 #include <linux/of_address.h>
@@ -25,6 +26,17 @@
 #include <linux/irq.h>
 #include <linux/irqdesc.h>
 #include <linux/reboot.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/hardirq.h>
+#include <asm/irq_regs.h>
+#include <asm/ptrace.h>
 #include <trace/events/irq.h>
 #include <linux/irqchip/arm-gic.h>
 #include "watchdog_pretimeout.h"
@@ -55,6 +67,7 @@
 #define WDT_TIMER_ENABLE	0x1
 #define WDT_MAX_CYCLE_COUNT	0xffffffff
 #define WDT_MAX_DURATION	0xffffffff / 1000
+#define WDT_MIN_TIMEOUT_MS	2	/* TTCR holds half of it */
 
 /*
  * APS timers_mv Watchdog timer block registers.
@@ -73,67 +86,286 @@
 #define APS_TMR_MAGIC1	0xbaba
 #define APS_TMR_MAGIC2	0xeb10
 
+/*
+ * Pretimeout stall records, one per cpu, kept in a reserved memory region
+ * ("memory-region" in the device tree) that survives the watchdog reset
+ */
+#define WDT_STALL_MAGIC		0x57445431	/* "WDT1" */
+#define WDT_STALL_STACK_WORDS	16
+
+struct pegmatite_wdt_stall {
+	u32 magic;
+	u32 cpu;
+	u32 pc;
+	u32 lr;
+	u32 sp;
+	u32 cpsr;
+	u32 pid;
+	char comm[TASK_COMM_LEN];
+	u32 preempt_count;
+	u32 jiffies;
+	u32 nr_stack;
+	u32 stack[WDT_STALL_STACK_WORDS];
+};
+
+/*
+ * Ping statistics: the interval between pings from the watchdog core and
+ * the margin left before the timeout at each ping.  Bucket b counts times in
+ * [2^(b-1), 2^b) ms, the last one everything above.
+ */
+#define WDT_STATS_BUCKETS	24
+
+struct pegmatite_wdt_hist {
+	u32 buckets[WDT_STATS_BUCKETS];
+	u64 count;
+	u64 total_ms;
+	u64 min_ms;
+	u64 max_ms;
+};
+
 static bool nowayout = WATCHDOG_NOWAYOUT;
 static int heartbeat = -1;		/* module parameter (seconds) */
 
 struct pegmatite_wdt_data {
-	struct watchdog_device wdt;
+	struct watchdog_device *wdt_dev;	/* the registered device */
 	void __iomem *reg;	/* Regs in MPMU for TIMERS watchdog */
 	void __iomem *aps_reg;	/* Regs in APS for timers_mv watchdog */
 	int irq;
-	int irq_enabled;
+	unsigned long irq_enabled;	/* bit 0, changed atomically for the FIQ */
+	/*
+	 * Covers both blocks, including the APS magic sequence.  The
+	 * pretimeout handler runs as a FIQ, which spin_lock_irqsave doesn't
+	 * mask, so it only ever trylocks this.
+	 */
 	spinlock_t lock;
+	/*
+	 * What the ping writes, so it doesn't have to read anything back:
+	 * TCR as programmed by start, and the TWR service field written last
+	 */
+	u32 tcr;
+	u32 twr_service;
+	/*
+	 * Longest period the hardware can be programmed for (see
+	 * pegmatite_wdt_max_hw_heartbeat_ms()), and what it is programmed for
+	 */
+	unsigned int max_hw_heartbeat_ms;
+	unsigned int hw_timeout_ms;
+	/* APS match for the pretimeout in 1/256 s, 0 when it is too short */
+	u32 pretimeout_expiry;
+	/* Sub-second timeout set through sysfs, 0 to use the core's timeout */
+	unsigned int timeout_ms;
+	/*
+	 * Timeouts longer than the hardware can do are kept by pinging the
+	 * hardware from here until the last ping from the watchdog core plus
+	 * the timeout, less one hardware period
+	 */
+	unsigned long last_keepalive;	/* jiffies */
+	unsigned long hw_expires;	/* jiffies, last hardware ping + period */
+	struct delayed_work keepalive_work;
+	/* Pretimeout stall records, NULL without a reserved region */
+	struct pegmatite_wdt_stall __iomem *stall;
+	unsigned int nr_stall;
+	/* Ping statistics, shown in debugfs */
+	ktime_t last_ping;
+	struct pegmatite_wdt_hist interval;
+	struct pegmatite_wdt_hist margin;
+	/* Last ping_bench run, see pegmatite_wdt_ping_bench_write() */
+	unsigned int bench_count;
+	u64 bench_ns;
+	struct dentry *debugfs;
 };
 
 static int timeout_on_panic = 30;
 static DEVICE_INT_ATTR(timeout_on_panic, 0644, timeout_on_panic);
 
-static struct device_attribute *pegmatite_wdt_attrs[] = {
-	&dev_attr_timeout_on_panic.attr,
-};
-
+/*
+ * The 3 register writes need to be atomic, so the caller holds wdt->lock
+ * (or is past caring, on panic and restart).  Device writes are kept in
+ * order, so only the last one needs a barrier.
+ */
 static void aps_watchdog_writel(struct pegmatite_wdt_data *wdt, u32 v, int off)
 {
 	void __iomem *aps_reg = wdt->aps_reg;
-	unsigned long flags;
-	static DEFINE_SPINLOCK(__aps_writel_lock);
 
-	/* These 3 register operations need to be atomic */
-	spin_lock_irqsave(&__aps_writel_lock, flags);
 	/* Magic value sequence has to be written before every write */
-	writel(APS_TMR_MAGIC1, aps_reg + APS_TMR_WFAR);
-	writel(APS_TMR_MAGIC2, aps_reg + APS_TMR_WSAR);
+	writel_relaxed(APS_TMR_MAGIC1, aps_reg + APS_TMR_WFAR);
+	writel_relaxed(APS_TMR_MAGIC2, aps_reg + APS_TMR_WSAR);
 	writel(v, aps_reg + off);
-	spin_unlock_irqrestore(&__aps_writel_lock, flags);
 }
 
-static int pegmatite_wdt_ping(struct watchdog_device *wdt_dev)
+/*
+ * Six posted writes and no reads, under the one lock
+ */
+static void __pegmatite_wdt_ping(struct pegmatite_wdt_data *wdt)
 {
-	struct pegmatite_wdt_data *wdt = watchdog_get_drvdata(wdt_dev);
-	u32 val;
+	void __iomem *aps_reg = wdt->aps_reg;
+	unsigned long flags;
 
-	spin_lock(&wdt->lock);
+	spin_lock_irqsave(&wdt->lock, flags);
 
 	/* Reset the timer back to 0 by disabling/enabling it.
 	 * We do this so the IRQ only fires as a pre-watchdog (indicating we
 	 * never serviced it again in the entire window). */
-	val = readl(wdt->reg + TCR);
-	writel(val & ~(WDT_TIMER_ENABLE), wdt->reg + TCR);
-	writel(val, wdt->reg + TCR);
+	writel_relaxed(wdt->tcr & ~(WDT_TIMER_ENABLE), wdt->reg + TCR);
+	writel_relaxed(wdt->tcr, wdt->reg + TCR);
 
-	/* Read the service field of TWR */
-	val = (readl(wdt->reg + TWR) & WDT_SERVICE_MASK);
+	/* xor the service field of TWR with 0xf and write it back */
+	wdt->twr_service ^= 0xf;
+	writel_relaxed(WDT_ENABLE | wdt->twr_service, wdt->reg + TWR);
 
-	/* xor it with 0xf */
-	val ^= 0xf;
+	/* Service the APS timers_mv watchdog block */
+	writel_relaxed(APS_TMR_MAGIC1, aps_reg + APS_TMR_WFAR);
+	writel_relaxed(APS_TMR_MAGIC2, aps_reg + APS_TMR_WSAR);
+	writel_relaxed(1, aps_reg + APS_TMR_WCR);
 
-	/* Write it back */
-	writel(WDT_ENABLE | val, wdt->reg + TWR);
+	spin_unlock_irqrestore(&wdt->lock, flags);
+}
 
-	/* Service the APS timers_mv watchdog block */
-	aps_watchdog_writel(wdt, 1, APS_TMR_WCR);
+/*
+ * The pretimeout match is 16 bits of 1/256 s and fires at a percentage of
+ * the timeout, so with the pretimeout in use a longer timeout would get its
+ * pretimeout early.  Otherwise TTCR holds half the timeout in ms (the
+ * hardware wraps twice before resetting), which is what WDT_MAX_DURATION
+ * allows for.
+ */
+static unsigned int pegmatite_wdt_max_hw_heartbeat_ms(void)
+{
+	unsigned int max_ms = WDT_MAX_DURATION * 1000U;
+	int percent;
+
+	if (watchdog_pretimeout_enabled()) {
+		percent = watchdog_pretimeout_percent();
+		if (percent > 0)
+			max_ms = min_t(u64, max_ms,
+				       div_u64((u64)APS_TMR_MAX * 1000 * 100, APS_TMR_HZ * percent));
+	}
+
+	return max_ms;
+}
+
+/*
+ * The timeout actually in use.  Fits since max_timeout is WDT_MAX_DURATION.
+ */
+static unsigned int pegmatite_wdt_timeout_ms(struct watchdog_device *wdt_dev)
+{
+	struct pegmatite_wdt_data *wdt = watchdog_get_drvdata(wdt_dev);
+
+	return wdt->timeout_ms ? wdt->timeout_ms : wdt_dev->timeout * 1000U;
+}
+
+static bool pegmatite_wdt_need_keepalive(struct watchdog_device *wdt_dev)
+{
+	struct pegmatite_wdt_data *wdt = watchdog_get_drvdata(wdt_dev);
+
+	return pegmatite_wdt_timeout_ms(wdt_dev) > wdt->hw_timeout_ms;
+}
+
+static unsigned long pegmatite_wdt_deadline(struct watchdog_device *wdt_dev)
+{
+	struct pegmatite_wdt_data *wdt = watchdog_get_drvdata(wdt_dev);
+
+	return wdt->last_keepalive + msecs_to_jiffies(pegmatite_wdt_timeout_ms(wdt_dev));
+}
+
+/*
+ * Next keepalive run: every half hardware period, and last at the point
+ * where one more hardware period ends exactly at the deadline
+ */
+static unsigned long pegmatite_wdt_keepalive_delay(unsigned long hw_period,
+						   unsigned long deadline,
+						   unsigned long now)
+{
+	return min(hw_period / 2, deadline - hw_period - now);
+}
+
+/*
+ * Ping the hardware for as long as a full hardware period still ends at or
+ * before the logical deadline.  The last ping is placed so the hardware
+ * expires at the deadline.
+ */
+static void pegmatite_wdt_keepalive_work(struct work_struct *work)
+{
+	struct pegmatite_wdt_data *wdt = container_of(to_delayed_work(work),
+				struct pegmatite_wdt_data, keepalive_work);
+	struct watchdog_device *wdt_dev = wdt->wdt_dev;
+	unsigned long hw_period = msecs_to_jiffies(wdt->hw_timeout_ms);
+	unsigned long deadline = pegmatite_wdt_deadline(wdt_dev);
+	unsigned long now = jiffies;
+
+	if (!watchdog_active(wdt_dev) || !pegmatite_wdt_need_keepalive(wdt_dev))
+		return;
+
+	/*
+	 * Only a late run gets here past the last ping point.  Ping anyway
+	 * if that puts the hardware expiry closer to the deadline than
+	 * leaving it where the previous ping put it.
+	 */
+	if (time_after(now + hw_period, deadline) &&
+	    (long)(now + hw_period - deadline) >= (long)(deadline - wdt->hw_expires))
+		return;
+
+	__pegmatite_wdt_ping(wdt);
+	wdt->hw_expires = now + hw_period;
+
+	if (time_before(now + hw_period, deadline))
+		schedule_delayed_work(&wdt->keepalive_work,
+				      pegmatite_wdt_keepalive_delay(hw_period, deadline, now));
+}
+
+static void pegmatite_wdt_keepalive(struct watchdog_device *wdt_dev)
+{
+	struct pegmatite_wdt_data *wdt = watchdog_get_drvdata(wdt_dev);
+	unsigned long hw_period = msecs_to_jiffies(wdt->hw_timeout_ms);
+	unsigned long now = jiffies;
+
+	wdt->last_keepalive = now;
+	wdt->hw_expires = now + hw_period;
+	if (pegmatite_wdt_need_keepalive(wdt_dev))
+		mod_delayed_work(system_wq, &wdt->keepalive_work,
+				 pegmatite_wdt_keepalive_delay(hw_period,
+						pegmatite_wdt_deadline(wdt_dev), now));
+}
+
+static void pegmatite_wdt_hist_add(struct pegmatite_wdt_hist *hist, u64 ms)
+{
+	hist->buckets[min_t(unsigned int, fls64(ms), WDT_STATS_BUCKETS - 1)]++;
+	if (!hist->count || ms < hist->min_ms)
+		hist->min_ms = ms;
+	if (ms > hist->max_ms)
+		hist->max_ms = ms;
+	hist->count++;
+	hist->total_ms += ms;
+}
+
+/*
+ * Pings come from userspace through the core, so the interval between them
+ * is mostly how late the daemon got to run.  A negative margin would have
+ * been a reset, and counts as 0.
+ */
+static void pegmatite_wdt_ping_stats(struct watchdog_device *wdt_dev)
+{
+	struct pegmatite_wdt_data *wdt = watchdog_get_drvdata(wdt_dev);
+	ktime_t now = ktime_get();
+	s64 interval_ms, margin_ms;
+
+	if (ktime_to_ns(wdt->last_ping)) {
+		interval_ms = ktime_ms_delta(now, wdt->last_ping);
+		margin_ms = (s64)pegmatite_wdt_timeout_ms(wdt_dev) - interval_ms;
+
+		pegmatite_wdt_hist_add(&wdt->interval, interval_ms);
+		pegmatite_wdt_hist_add(&wdt->margin, margin_ms > 0 ? margin_ms : 0);
+	}
+	wdt->last_ping = now;
+}
+
+static int pegmatite_wdt_ping(struct watchdog_device *wdt_dev)
+{
+	struct pegmatite_wdt_data *wdt = watchdog_get_drvdata(wdt_dev);
+
+	pegmatite_wdt_ping_stats(wdt_dev);
+	__pegmatite_wdt_ping(wdt);
+	pegmatite_wdt_keepalive(wdt_dev);
 
-	spin_unlock(&wdt->lock);
 	return 0;
 }
 
@@ -143,25 +375,45 @@ static void  __set_hw_pretimeout(struct watchdog_device *wdt_dev)
 	u32 expiry;
 	int percent;
 
-	/* This does not overflow since the clock rate is so low */
+	/* Relative to the period the hardware is actually programmed for */
 	percent = watchdog_pretimeout_percent();
-	expiry = (percent * wdt_dev->timeout * APS_TMR_HZ) / 100;
+	expiry = (u32)div_u64((u64)percent * wdt->hw_timeout_ms * APS_TMR_HZ, 100 * 1000);
 	if (expiry > APS_TMR_MAX)
 		expiry = APS_TMR_MAX;
+	wdt->pretimeout_expiry = expiry;
+
+	/*
+	 * A pretimeout shorter than one APS tick can't be matched: at 0 it
+	 * would fire straight away, and any later tick lands after the reset.
+	 * Such short timeouts go without a pretimeout.
+	 */
+	if (!expiry) {
+		aps_watchdog_writel(wdt, 0, APS_TMR_WMER);
+		return;
+	}
 
 	aps_watchdog_writel(wdt, expiry, APS_TMR_WMR);
+	if (test_bit(0, &wdt->irq_enabled))
+		aps_watchdog_writel(wdt, 1, APS_TMR_WMER);
 }
 
 static void  __set_hw_timeout(struct watchdog_device *wdt_dev)
 {
 	struct pegmatite_wdt_data *wdt = watchdog_get_drvdata(wdt_dev);
 
+	/*
+	 * Longer timeouts are made up by the keepalive work
+	 */
+	wdt->max_hw_heartbeat_ms = pegmatite_wdt_max_hw_heartbeat_ms();
+	wdt->hw_timeout_ms = min(pegmatite_wdt_timeout_ms(wdt_dev),
+				 wdt->max_hw_heartbeat_ms);
+
 	/*
 	 * Set watchdog duration in milliseconds. Note, this hardware wraps
 	 * twice before it actually resets the system, so we need to set it for
 	 * half the requested timeout.
 	 */
-	writel(wdt_dev->timeout * 1000 / 2, wdt->reg + TTCR);
+	writel(wdt->hw_timeout_ms / 2, wdt->reg + TTCR);
 
 	__set_hw_pretimeout(wdt_dev);
 }
@@ -189,10 +441,8 @@ static int pegmatite_wdt_disable_pretimeout_irq(struct watchdog_device *wdt_dev)
 {
 	struct pegmatite_wdt_data *wdt = watchdog_get_drvdata(wdt_dev);
 
-	if (wdt->irq_enabled) {
+	if (test_and_clear_bit(0, &wdt->irq_enabled))
 		disable_irq_nosync(wdt->irq);
-		wdt->irq_enabled = 0;
-	}
 	/* Disable APS watchdog block */
 	aps_watchdog_writel(wdt, 0, APS_TMR_WMER);
 	/* Clear any pending interrupt */
@@ -205,12 +455,15 @@ static int pegmatite_wdt_disable_pretimeout_irq(struct watchdog_device *wdt_dev)
 static int pegmatite_wdt_stop(struct watchdog_device *wdt_dev)
 {
 	struct pegmatite_wdt_data *wdt = watchdog_get_drvdata(wdt_dev);
+	unsigned long flags;
+
+	cancel_delayed_work_sync(&wdt->keepalive_work);
 
-	spin_lock(&wdt->lock);
+	spin_lock_irqsave(&wdt->lock, flags);
 	pegmatite_wdt_stop_unlocked(wdt_dev);
 	if (watchdog_pretimeout_enabled())
 		pegmatite_wdt_disable_pretimeout_irq(wdt_dev);
-	spin_unlock(&wdt->lock);
+	spin_unlock_irqrestore(&wdt->lock, flags);
 	return 0;
 }
 
@@ -223,19 +476,19 @@ static int pegmatite_wdt_enable_pretimeout_irq(struct watchdog_device *wdt_dev)
 	/* Clear the WDT timer count */
 	aps_watchdog_writel(wdt, 1, APS_TMR_WCR);
 	/* Enable the APS timers_mv watchdog block in IRQ only mode */
-	aps_watchdog_writel(wdt, 1, APS_TMR_WMER);
-	if (!wdt->irq_enabled) {
+	if (wdt->pretimeout_expiry)
+		aps_watchdog_writel(wdt, 1, APS_TMR_WMER);
+	if (!test_and_set_bit(0, &wdt->irq_enabled))
 		enable_irq(wdt->irq);
-		wdt->irq_enabled = 1;
-	}
 	return 0;
 }
 
 static int pegmatite_wdt_start(struct watchdog_device *wdt_dev)
 {
 	struct pegmatite_wdt_data *wdt = watchdog_get_drvdata(wdt_dev);
+	unsigned long flags;
 
-	spin_lock(&wdt->lock);
+	spin_lock_irqsave(&wdt->lock, flags);
 
 	/*
 	 * If wdog was already armed (e.g. if we just booted into a crash
@@ -249,14 +502,19 @@ static int pegmatite_wdt_start(struct watchdog_device *wdt_dev)
 	__set_hw_timeout(wdt_dev);
 
 	/* Set timer enable, continuous mode, and 1ms timebase */
-	writel(WDT_TIMER_ENABLE | WDT_CONTINUOUS_MODE | (WDT_ONE_MS << WDT_TIMEBASE_SHIFT), wdt->reg + TCR);
+	wdt->tcr = WDT_TIMER_ENABLE | WDT_CONTINUOUS_MODE | (WDT_ONE_MS << WDT_TIMEBASE_SHIFT);
+	writel(wdt->tcr, wdt->reg + TCR);
 
-	writel(WDT_ENABLE, wdt->reg + TWR);
+	wdt->twr_service = 0;
+	writel(WDT_ENABLE | wdt->twr_service, wdt->reg + TWR);
 
 	if (watchdog_pretimeout_enabled())
 		pegmatite_wdt_enable_pretimeout_irq(wdt_dev);
 
-	spin_unlock(&wdt->lock);
+	spin_unlock_irqrestore(&wdt->lock, flags);
+
+	wdt->last_ping = ktime_get();
+	pegmatite_wdt_keepalive(wdt_dev);
 	return 0;
 }
 
@@ -265,8 +523,22 @@ static unsigned int pegmatite_wdt_get_timeleft(struct watchdog_device *wdt_dev)
 	struct pegmatite_wdt_data *wdt = watchdog_get_drvdata(wdt_dev);
 	unsigned int time_left;
 	unsigned int terminal_count;
+	unsigned long deadline, now;
+	unsigned long flags;
 
-	spin_lock(&wdt->lock);
+	/*
+	 * While the keepalive work is covering for the hardware, the time
+	 * left is up to the logical deadline
+	 */
+	if (pegmatite_wdt_need_keepalive(wdt_dev)) {
+		deadline = pegmatite_wdt_deadline(wdt_dev);
+		now = jiffies;
+		if (time_after_eq(now, deadline))
+			return 0;
+		return (deadline - now) / HZ;
+	}
+
+	spin_lock_irqsave(&wdt->lock, flags);
 
 	/* Read terminal count. This watchdog block only resets the system when
 	 * the termincal count in TTCR is reached *and* no service ping has
@@ -279,33 +551,233 @@ static unsigned int pegmatite_wdt_get_timeleft(struct watchdog_device *wdt_dev)
 	 * actually serviced it in this interval. */
 	time_left = (2*terminal_count - readl(wdt->reg + TSR)) / 1000;
 
-	spin_unlock(&wdt->lock);
+	spin_unlock_irqrestore(&wdt->lock, flags);
 
 	return time_left;
 }
 
 /*
- * We don't need any locks here, and need to avoid them anyways because this
- * can be called when we're panicking from any context
+ * This can be called when we're panicking from any context, where waiting
+ * on our lock won't help anything, so then only try it and carry on either
+ * way.  For the same reason the keepalive work isn't touched; the core pings
+ * right after a new timeout, and once we have panicked a timeout beyond the
+ * hardware maximum simply expires after one hardware period.
  */
 static int pegmatite_wdt_set_timeout(struct watchdog_device *wdt_dev,
 				 unsigned int timeout)
 {
+	struct pegmatite_wdt_data *wdt = watchdog_get_drvdata(wdt_dev);
+	unsigned long flags;
+	int locked = 1;
+
+	if (oops_in_progress)
+		locked = spin_trylock_irqsave(&wdt->lock, flags);
+	else
+		spin_lock_irqsave(&wdt->lock, flags);
+
+	/* A timeout in seconds replaces any set in ms */
+	wdt->timeout_ms = 0;
 	wdt_dev->timeout = timeout;
 	__set_hw_timeout(wdt_dev);
 
+	if (locked)
+		spin_unlock_irqrestore(&wdt->lock, flags);
+
 	return 0;
 }
 
+/*
+ * Record what this cpu was doing when the pretimeout hit.  Every cpu takes
+ * the pretimeout FIQ and writes only its own record, so no locking.  Only
+ * kernel stacks are copied, and only as far as the task's stack goes.
+ */
+static void pegmatite_wdt_sample_stall(struct pegmatite_wdt_data *wdt)
+{
+	struct pt_regs *regs = get_irq_regs();
+	struct pegmatite_wdt_stall rec;
+	unsigned int cpu = raw_smp_processor_id();
+	unsigned long stack_end;
+	u32 *sp;
+
+	if (!wdt->stall || cpu >= wdt->nr_stall)
+		return;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.magic = WDT_STALL_MAGIC;
+	rec.cpu = cpu;
+	rec.pid = task_pid_nr(current);
+	memcpy(rec.comm, current->comm, sizeof(rec.comm));
+	rec.preempt_count = preempt_count();
+	rec.jiffies = (u32)jiffies;
+
+	if (regs) {
+		rec.pc = regs->ARM_pc;
+		rec.lr = regs->ARM_lr;
+		rec.sp = regs->ARM_sp;
+		rec.cpsr = regs->ARM_cpsr;
+
+		stack_end = (unsigned long)task_stack_page(current) + THREAD_SIZE;
+		if (!user_mode(regs) && object_is_on_stack((void *)rec.sp)) {
+			for (sp = (u32 *)rec.sp;
+			     rec.nr_stack < WDT_STALL_STACK_WORDS &&
+			     (unsigned long)sp < stack_end; sp++)
+				rec.stack[rec.nr_stack++] = *sp;
+		}
+	}
+
+	memcpy_toio(&wdt->stall[cpu], &rec, sizeof(rec));
+	wmb();
+}
+
+/*
+ * Report the records left by a pretimeout before the last reset, then clear
+ * them for the next one
+ */
+static void pegmatite_wdt_report_stalls(struct device *dev,
+					struct pegmatite_wdt_data *wdt)
+{
+	struct pegmatite_wdt_stall rec;
+	unsigned int i, j;
+
+	for (i = 0; i < wdt->nr_stall; i++) {
+		memcpy_fromio(&rec, &wdt->stall[i], sizeof(rec));
+		if (rec.magic != WDT_STALL_MAGIC)
+			continue;
+
+		rec.comm[TASK_COMM_LEN - 1] = '\0';
+		rec.nr_stack = min_t(u32, rec.nr_stack, WDT_STALL_STACK_WORDS);
+		dev_warn(dev, "pretimeout cpu%u: pc %08x lr %08x sp %08x cpsr %08x (irqs %s, %s mode)\n",
+			 rec.cpu, rec.pc, rec.lr, rec.sp, rec.cpsr,
+			 rec.cpsr & PSR_I_BIT ? "off" : "on",
+			 (rec.cpsr & MODE_MASK) == USR_MODE ? "user" : "kernel");
+		dev_warn(dev, "pretimeout cpu%u: pid %u comm %s preempt_count %08x jiffies %u\n",
+			 rec.cpu, rec.pid, rec.comm, rec.preempt_count, rec.jiffies);
+		for (j = 0; j < rec.nr_stack; j += 4)
+			dev_warn(dev, "pretimeout cpu%u: stack %08x: %08x %08x %08x %08x\n",
+				 rec.cpu, rec.sp + j * 4, rec.stack[j],
+				 j + 1 < rec.nr_stack ? rec.stack[j + 1] : 0,
+				 j + 2 < rec.nr_stack ? rec.stack[j + 2] : 0,
+				 j + 3 < rec.nr_stack ? rec.stack[j + 3] : 0);
+	}
+
+	memset_io(wdt->stall, 0, wdt->nr_stall * sizeof(rec));
+}
+
+static void pegmatite_wdt_init_stall(struct platform_device *pdev,
+				     struct pegmatite_wdt_data *wdt)
+{
+	struct device_node *np;
+	struct resource res;
+	int ret;
+
+	np = of_parse_phandle(pdev->dev.of_node, "memory-region", 0);
+	if (!np)
+		return;
+
+	ret = of_address_to_resource(np, 0, &res);
+	of_node_put(np);
+	if (ret) {
+		dev_err(&pdev->dev, "Failed to get stall record region\n");
+		return;
+	}
+
+	wdt->nr_stall = min_t(resource_size_t, num_possible_cpus(),
+			      resource_size(&res) / sizeof(struct pegmatite_wdt_stall));
+	if (!wdt->nr_stall)
+		return;
+
+	wdt->stall = devm_ioremap_nocache(&pdev->dev, res.start,
+			wdt->nr_stall * sizeof(struct pegmatite_wdt_stall));
+	if (!wdt->stall) {
+		dev_err(&pdev->dev, "Failed to map stall record region\n");
+		wdt->nr_stall = 0;
+		return;
+	}
+
+	pegmatite_wdt_report_stalls(&pdev->dev, wdt);
+}
+
+/*
+ * Sub-second timeouts, for callers that need to notice a hang quickly.  The
+ * core only knows whole seconds, so it sees the ms value rounded up.
+ * Writing 0 goes back to the core's timeout.
+ */
+static ssize_t timeout_ms_show(struct device *dev, struct device_attribute *attr,
+			       char *buf)
+{
+	struct watchdog_device *wdt_dev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", pegmatite_wdt_timeout_ms(wdt_dev));
+}
+
+static ssize_t timeout_ms_store(struct device *dev, struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct watchdog_device *wdt_dev = dev_get_drvdata(dev);
+	struct pegmatite_wdt_data *wdt = watchdog_get_drvdata(wdt_dev);
+	unsigned long flags;
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	if (val && (val < WDT_MIN_TIMEOUT_MS || val > wdt_dev->max_timeout * 1000U))
+		return -EINVAL;
+
+	/*
+	 * The core's lock keeps this apart from WDIOC_SETTIMEOUT and pings,
+	 * which also use wdt_dev->timeout
+	 */
+	mutex_lock(&wdt_dev->lock);
+
+	spin_lock_irqsave(&wdt->lock, flags);
+	wdt->timeout_ms = val;
+	if (val)
+		wdt_dev->timeout = DIV_ROUND_UP(val, 1000);
+	__set_hw_timeout(wdt_dev);
+	spin_unlock_irqrestore(&wdt->lock, flags);
+
+	/* Start the new period now */
+	if (watchdog_active(wdt_dev)) {
+		__pegmatite_wdt_ping(wdt);
+		pegmatite_wdt_keepalive(wdt_dev);
+	}
+
+	mutex_unlock(&wdt_dev->lock);
+
+	return count;
+}
+static DEVICE_ATTR_RW(timeout_ms);
+
+static struct device_attribute *pegmatite_wdt_attrs[] = {
+	&dev_attr_timeout_on_panic.attr,
+	&dev_attr_timeout_ms,
+};
+
 static irqreturn_t pegmatite_wdt_irq(int irq, void *dev_id)
 {
 	struct watchdog_device *wdt_dev = dev_id;
+	struct pegmatite_wdt_data *wdt = watchdog_get_drvdata(wdt_dev);
+	unsigned long flags;
+
+	pegmatite_wdt_sample_stall(wdt);
 
 	watchdog_pretimeout_handle();
 
 	/* The above only returns if the pretimeout is disabled.
-	 * So, disable the pretimeout irq and return. */
-	pegmatite_wdt_disable_pretimeout_irq(wdt_dev);
+	 * So, disable the pretimeout irq and return.
+	 * This is a FIQ and may have interrupted the lock holder on this
+	 * cpu, so only try the lock.  Without it, just mask the irq so it
+	 * stops firing, and leave the APS block to whoever holds the lock
+	 * or to the next start. */
+	if (spin_trylock_irqsave(&wdt->lock, flags)) {
+		pegmatite_wdt_disable_pretimeout_irq(wdt_dev);
+		spin_unlock_irqrestore(&wdt->lock, flags);
+	} else if (test_and_clear_bit(0, &wdt->irq_enabled)) {
+		disable_irq_nosync(wdt->irq);
+	}
 
 	return IRQ_HANDLED;
 }
@@ -354,6 +826,130 @@ static struct pegmatite_wdt_notifier_block pegmatite_wdt_panic_notifier = {
 	},
 };
 
+static void pegmatite_wdt_hist_show(struct seq_file *s, const char *name,
+				    struct pegmatite_wdt_hist *hist)
+{
+	seq_printf(s, "%-8s count %llu avg %llu ms min %llu ms max %llu ms\n",
+		   name, hist->count,
+		   hist->count ? div64_u64(hist->total_ms, hist->count) : 0,
+		   hist->min_ms, hist->max_ms);
+}
+
+static int pegmatite_wdt_stats_show(struct seq_file *s, void *unused)
+{
+	struct pegmatite_wdt_data *wdt = s->private;
+	unsigned int b;
+
+	pegmatite_wdt_hist_show(s, "interval", &wdt->interval);
+	pegmatite_wdt_hist_show(s, "margin", &wdt->margin);
+
+	seq_printf(s, "\n%12s %9s %9s\n", "ms <", "interval", "margin");
+	for (b = 0; b < WDT_STATS_BUCKETS; b++) {
+		if (!wdt->interval.buckets[b] && !wdt->margin.buckets[b])
+			continue;
+
+		if (b == WDT_STATS_BUCKETS - 1)
+			seq_printf(s, "%12s", "inf");
+		else
+			seq_printf(s, "%12llu", 1ULL << b);
+		seq_printf(s, " %9u %9u\n", wdt->interval.buckets[b],
+			   wdt->margin.buckets[b]);
+	}
+
+	return 0;
+}
+
+static int pegmatite_wdt_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pegmatite_wdt_stats_show, inode->i_private);
+}
+
+/*
+ * Writing anything clears the statistics
+ */
+static ssize_t pegmatite_wdt_stats_write(struct file *file, const char __user *buf,
+					 size_t count, loff_t *ppos)
+{
+	struct pegmatite_wdt_data *wdt = file_inode(file)->i_private;
+
+	memset(&wdt->interval, 0, sizeof(wdt->interval));
+	memset(&wdt->margin, 0, sizeof(wdt->margin));
+
+	return count;
+}
+
+static const struct file_operations pegmatite_wdt_stats_fops = {
+	.open		= pegmatite_wdt_stats_open,
+	.read		= seq_read,
+	.write		= pegmatite_wdt_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * ping_bench: writing N pings the hardware N times back to back and
+ * reading shows the average cost of the last run.  The timing stays out
+ * of the ping itself.  Only allowed while the watchdog is running, since
+ * a ping also arms the hardware.
+ */
+#define WDT_PING_BENCH_MAX	10000
+
+static int pegmatite_wdt_ping_bench_show(struct seq_file *s, void *unused)
+{
+	struct pegmatite_wdt_data *wdt = s->private;
+
+	seq_printf(s, "ping count %u avg %llu ns\n", wdt->bench_count,
+		   wdt->bench_count ? div64_u64(wdt->bench_ns, wdt->bench_count) : 0);
+
+	return 0;
+}
+
+static int pegmatite_wdt_ping_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pegmatite_wdt_ping_bench_show, inode->i_private);
+}
+
+static ssize_t pegmatite_wdt_ping_bench_write(struct file *file, const char __user *buf,
+					      size_t count, loff_t *ppos)
+{
+	struct pegmatite_wdt_data *wdt = file_inode(file)->i_private;
+	struct watchdog_device *wdt_dev = wdt->wdt_dev;
+	unsigned int n, i;
+	ktime_t start;
+	int ret;
+
+	ret = kstrtouint_from_user(buf, count, 0, &n);
+	if (ret)
+		return ret;
+
+	if (!n || n > WDT_PING_BENCH_MAX)
+		return -EINVAL;
+
+	mutex_lock(&wdt_dev->lock);
+	if (!watchdog_active(wdt_dev)) {
+		mutex_unlock(&wdt_dev->lock);
+		return -EBUSY;
+	}
+
+	start = ktime_get();
+	for (i = 0; i < n; i++)
+		__pegmatite_wdt_ping(wdt);
+	wdt->bench_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	wdt->bench_count = n;
+
+	mutex_unlock(&wdt_dev->lock);
+
+	return count;
+}
+
+static const struct file_operations pegmatite_wdt_ping_bench_fops = {
+	.open		= pegmatite_wdt_ping_bench_open,
+	.read		= seq_read,
+	.write		= pegmatite_wdt_ping_bench_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static const struct watchdog_info pegmatite_wdt_info = {
 	.options = WDIOF_SETTIMEOUT | WDIOF_KEEPALIVEPING | WDIOF_MAGICCLOSE,
 	.identity = "Pegmatite Watchdog",
@@ -397,11 +993,24 @@ static void handle_remain_latched_and_eoi_irq(unsigned int irq, struct irq_desc
 /* Global reference only for the restart handler */
 static struct watchdog_device *reboot_watchdog_dev;
 
+/*
+ * Reset as soon as the hardware allows: the smallest terminal count, which
+ * with the double wrap is about 2 ms, and no pretimeout.  No locks, for the
+ * same reason as on panic.
+ */
 static int pegmatite_wdt_system_restart(struct notifier_block *nb, unsigned long mode, void *cmd)
 {
-	/* Set timeout to a small value */
-	reboot_watchdog_dev->timeout = 1;
-	pegmatite_wdt_start(reboot_watchdog_dev);
+	struct pegmatite_wdt_data *wdt = watchdog_get_drvdata(reboot_watchdog_dev);
+
+	pegmatite_wdt_stop_unlocked(reboot_watchdog_dev);
+
+	/* Keep the pretimeout from firing in the meantime */
+	aps_watchdog_writel(wdt, 0, APS_TMR_WMER);
+	aps_watchdog_writel(wdt, 1, APS_TMR_WICR);
+
+	writel(1, wdt->reg + TTCR);
+	writel(WDT_TIMER_ENABLE | WDT_CONTINUOUS_MODE | (WDT_ONE_MS << WDT_TIMEBASE_SHIFT), wdt->reg + TCR);
+	writel(WDT_ENABLE, wdt->reg + TWR);
 
 	while (true)
 		;
@@ -439,8 +1048,10 @@ static int pegmatite_wdt_probe(struct platform_device *pdev)
 	wdt_dev->max_timeout = WDT_MAX_DURATION;
 	wdt_dev->timeout = WDT_MAX_DURATION;
 	watchdog_set_drvdata(wdt_dev, wdt);
+	wdt->wdt_dev = wdt_dev;
 
 	spin_lock_init(&wdt->lock);
+	INIT_DELAYED_WORK(&wdt->keepalive_work, pegmatite_wdt_keepalive_work);
 
 	wdt->reg = devm_ioremap_resource(&pdev->dev,
 			platform_get_resource(pdev, IORESOURCE_MEM, 0));
@@ -458,6 +1069,8 @@ static int pegmatite_wdt_probe(struct platform_device *pdev)
 
 	pegmatite_wdt_disable_pretimeout_irq(wdt_dev);
 
+	pegmatite_wdt_init_stall(pdev, wdt);
+
 	irq = platform_get_irq(pdev, 0);
 	if (irq > 0) {
 		wdt->irq = irq;
@@ -489,8 +1102,17 @@ static int pegmatite_wdt_probe(struct platform_device *pdev)
 	atomic_notifier_chain_register(&panic_notifier_list,
 		&pegmatite_wdt_panic_notifier.nblock);
 
-	pr_info("pegmatite_wdt: Initial timeout %d sec%s\n",
-		wdt_dev->timeout, nowayout ? ", nowayout" : "");
+	wdt->debugfs = debugfs_create_dir("pegmatite_wdt", NULL);
+	if (!IS_ERR_OR_NULL(wdt->debugfs)) {
+		debugfs_create_file("stats", S_IRUGO | S_IWUSR, wdt->debugfs,
+				    wdt, &pegmatite_wdt_stats_fops);
+		debugfs_create_file("ping_bench", S_IRUGO | S_IWUSR, wdt->debugfs,
+				    wdt, &pegmatite_wdt_ping_bench_fops);
+	}
+
+	pr_info("pegmatite_wdt: Initial timeout %d sec%s, hardware max %u ms\n",
+		wdt_dev->timeout, nowayout ? ", nowayout" : "",
+		pegmatite_wdt_max_hw_heartbeat_ms());
 
 	reboot_watchdog_dev = wdt_dev;
 	ret = register_restart_handler(&pegmatite_wdt_restart_handler);
@@ -511,8 +1133,10 @@ out_attrs:
 static int pegmatite_wdt_remove(struct platform_device *pdev)
 {
 	struct watchdog_device *wdt_dev = platform_get_drvdata(pdev);
+	struct pegmatite_wdt_data *wdt = watchdog_get_drvdata(wdt_dev);
 	int i;
 
+	debugfs_remove_recursive(wdt->debugfs);
 	unregister_restart_handler(&pegmatite_wdt_restart_handler);
 	reboot_watchdog_dev = NULL;
 	atomic_notifier_chain_unregister(&panic_notifier_list,